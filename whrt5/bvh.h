@@ -0,0 +1,386 @@
+#pragma once
+#include "cmmn.h"
+#include "packet.h"
+
+namespace whrt5 {
+	// a depth first traversal holds at most one node per level plus one on its stack, so trees are kept to
+	// bvh_max_depth levels and the stacks can be a fixed size
+	const uint32 bvh_max_depth = 48, bvh_stack_size = 64;
+	static_assert(bvh_max_depth < bvh_stack_size, "bvh traversal stacks must hold a path to the deepest leaf");
+
+	// true if splitting a node at depth into children of n0 and n1 objects could go past bvh_max_depth
+	// a node of at most 2^(bvh_max_depth - depth) objects that is split at the median all the way down stays within
+	// the limit, so builders split at the median instead whenever a child would be bigger than that
+	inline bool bvh_too_deep(uint32 depth, size_t n0, size_t n1) {
+		uint32 room = bvh_max_depth - glm::min(depth + 1, bvh_max_depth);
+		uint64_t limit = (uint64_t)1 << room;
+		return n0 > limit || n1 > limit;
+	}
+
+	/*
+		bounding volume hierarchy built with the surface area heuristic
+		T:	object type, must have aabb bounds(float t0, float t1) const, bool hit(const ray&, HR*) const,
+			bool occluded(const ray&, float) const, void prepare(float t0, float t1) and bool dynamic() const
+			for packets T must also have int hit4(const ray4&, int, HR4&) const and int occluded4(const ray4&, int, float4) const
+		HR:	hit record type that T::hit fills in
+
+		the tree is built for rays with times in [t0, t1], so moving objects are bounded over that interval
+		when the interval changes (e.g. every frame) update() refits the nodes above the objects that move
+		instead of building the whole tree again
+		nodes are stored depth first, so the first child of an interior node is always right after it
+		trees are never deeper than bvh_max_depth, however lopsided the SAH splits would make them
+		objects that report infinite bounds are kept out of the tree and tested against every ray
+	*/
+	template<typename T, typename HR>
+	class bvh {
+		struct node {
+			aabb bounds;
+			// interior: index of the second child, leaf: index of the first object in objs
+			uint32 offset;
+			// number of objects in the leaf, 0 for interior nodes
+			uint32 count;
+			// split axis for interior nodes, used to visit the nearer child first
+			uint32 axis;
+			uint32 parent;
+		};
+
+		struct build_ref {
+			aabb bounds;
+			vec3 centroid;
+			shared_ptr<T> obj;
+			bool dynamic;
+		};
+
+		vector<shared_ptr<T>> source;
+		vector<shared_ptr<T>> dynamic_source;
+		vector<node> nodes;
+		vector<shared_ptr<T>> objs;
+		vector<aabb> obj_bounds;
+		vector<shared_ptr<T>> unbounded;
+		// (index into objs, index of its leaf) for every object in the tree that moves
+		vector<pair<uint32, uint32>> dynamic_refs;
+		// total area of the moving objects when the tree was last built, to tell when refitting has made it too loose
+		float built_dynamic_area;
+		bool prepared = false;
+		// nodes touched by the current refit are marked with the refit's epoch
+		vector<uint32> refit_mark;
+		uint32 refit_epoch = 0;
+
+		static const uint32 no_parent = ~0u;
+		static const uint32 bin_count = 16;
+		static const uint32 max_leaf_size = 4;
+		static constexpr float rebuild_factor = 2.f;
+
+		uint32 build_node(vector<build_ref>& refs, size_t begin, size_t end, uint32 parent, uint32 depth) {
+			uint32 index = (uint32)nodes.size();
+			nodes.push_back(node());
+			nodes[index].parent = parent;
+
+			aabb b = refs[begin].bounds, cb(refs[begin].centroid, refs[begin].centroid);
+			for (size_t i = begin + 1; i < end; ++i) {
+				b.add_aabb(refs[i].bounds);
+				cb.add_point(refs[i].centroid);
+			}
+			nodes[index].bounds = b;
+
+			size_t count = end - begin;
+			auto make_leaf = [&]() {
+				nodes[index].offset = (uint32)objs.size();
+				nodes[index].count = (uint32)count;
+				for (size_t i = begin; i < end; ++i) {
+					if (refs[i].dynamic) {
+						dynamic_refs.push_back(make_pair((uint32)objs.size(), index));
+						built_dynamic_area += refs[i].bounds.surface_area();
+					}
+					objs.push_back(refs[i].obj);
+					obj_bounds.push_back(refs[i].bounds);
+				}
+				return index;
+			};
+			if (count <= 2) return make_leaf();
+
+			// find the cheapest binned split over all three axes
+			float best_cost = FLT_MAX; uint32 best_axis = 0, best_bin = 0;
+			vec3 ce = cb.extents();
+			for (uint32 axis = 0; axis < 3; ++axis) {
+				if (ce[axis] <= 0.f) continue;
+				aabb bins[bin_count]; uint32 bin_n[bin_count] = { 0 };
+				for (size_t i = begin; i < end; ++i) {
+					uint32 bi = glm::min(bin_count - 1, (uint32)(bin_count * (refs[i].centroid[axis] - cb._min[axis]) / ce[axis]));
+					bins[bi] = bin_n[bi] == 0 ? refs[i].bounds : aabb(bins[bi], refs[i].bounds);
+					bin_n[bi]++;
+				}
+				// sweep from the right to get the area and count of everything right of each split
+				float right_area[bin_count]; uint32 right_n[bin_count];
+				aabb rb; uint32 rn = 0;
+				for (uint32 i = bin_count - 1; i > 0; --i) {
+					if (bin_n[i] > 0) { rb = rn == 0 ? bins[i] : aabb(rb, bins[i]); rn += bin_n[i]; }
+					right_area[i] = rb.surface_area(); right_n[i] = rn;
+				}
+				aabb lb; uint32 ln = 0;
+				for (uint32 i = 0; i < bin_count - 1; ++i) {
+					if (bin_n[i] > 0) { lb = ln == 0 ? bins[i] : aabb(lb, bins[i]); ln += bin_n[i]; }
+					if (ln == 0 || right_n[i + 1] == 0) continue;
+					float cost = lb.surface_area()*ln + right_area[i + 1] * right_n[i + 1];
+					if (cost < best_cost) {
+						best_cost = cost; best_axis = axis; best_bin = i;
+					}
+				}
+			}
+
+			// traversal cost relative to intersection cost is taken as 1
+			bool found_split = best_cost < FLT_MAX;
+			best_cost = 1.f + best_cost / glm::max(b.surface_area(), 1e-12f);
+
+			size_t mid;
+			if (!found_split || (best_cost >= (float)count && count <= max_leaf_size)) {
+				if (count <= max_leaf_size) return make_leaf();
+				// all the centroids are in the same place, so just split the list in half
+				mid = begin + count / 2;
+			}
+			else {
+				auto pmid = partition(refs.begin() + begin, refs.begin() + end, [&](const build_ref& r) {
+					uint32 bi = glm::min(bin_count - 1, (uint32)(bin_count * (r.centroid[best_axis] - cb._min[best_axis]) / ce[best_axis]));
+					return bi <= best_bin;
+				});
+				mid = pmid - refs.begin();
+				if (mid == begin || mid == end) mid = begin + count / 2;
+			}
+			if (bvh_too_deep(depth, mid - begin, end - mid)) {
+				// median along the widest spread of centroids
+				best_axis = ce.x >= ce.y && ce.x >= ce.z ? 0 : (ce.y >= ce.z ? 1 : 2);
+				mid = begin + count / 2;
+				nth_element(refs.begin() + begin, refs.begin() + mid, refs.begin() + end, [&](const build_ref& a, const build_ref& b) {
+					return a.centroid[best_axis] < b.centroid[best_axis];
+				});
+			}
+
+			nodes[index].axis = best_axis;
+			nodes[index].count = 0;
+			build_node(refs, begin, mid, index, depth + 1);
+			nodes[index].offset = build_node(refs, mid, end, index, depth + 1);
+			return index;
+		}
+
+		// recompute the bounds of the moving objects and of every node above them
+		void refit(float t0, float t1) {
+			if (dynamic_refs.empty()) return;
+			refit_epoch++;
+			vector<uint32> dirty;
+			float area = 0.f;
+			for (const auto& d : dynamic_refs) {
+				obj_bounds[d.first] = objs[d.first]->bounds(t0, t1);
+				area += obj_bounds[d.first].surface_area();
+				for (uint32 n = d.second; n != no_parent && refit_mark[n] != refit_epoch; n = nodes[n].parent) {
+					refit_mark[n] = refit_epoch;
+					dirty.push_back(n);
+				}
+			}
+			if (!obj_bounds_finite(dynamic_refs) || area > rebuild_factor * built_dynamic_area) {
+				build(t0, t1);
+				return;
+			}
+			// children always come after their parent, so going backwards updates children first
+			sort(dirty.begin(), dirty.end(), greater<uint32>());
+			for (auto ni : dirty) {
+				node& n = nodes[ni];
+				if (n.count > 0) {
+					n.bounds = obj_bounds[n.offset];
+					for (uint32 i = n.offset + 1; i < n.offset + n.count; ++i)
+						n.bounds.add_aabb(obj_bounds[i]);
+				}
+				else n.bounds = aabb(nodes[ni + 1].bounds, nodes[n.offset].bounds);
+			}
+		}
+
+		bool obj_bounds_finite(const vector<pair<uint32, uint32>>& refs) const {
+			for (const auto& d : refs)
+				if (!obj_bounds[d.first].finite()) return false;
+			return true;
+		}
+	public:
+		bvh() {}
+		// create a tree over objects o, initially built for rays at time 0
+		bvh(const vector<shared_ptr<T>>& o) : source(o) {
+			for (const auto& x : source)
+				if (x->dynamic()) dynamic_source.push_back(x);
+			build(0.f, 0.f);
+		}
+
+		const vector<shared_ptr<T>>& objects() const { return source; }
+
+		// true if any object in the tree moves
+		bool dynamic() const { return !dynamic_source.empty(); }
+
+		// (re)build the whole tree for rays with times in [t0, t1]
+		void build(float t0, float t1) {
+			nodes.clear(); objs.clear(); obj_bounds.clear(); unbounded.clear(); dynamic_refs.clear();
+			built_dynamic_area = 0.f;
+			vector<build_ref> refs;
+			refs.reserve(source.size());
+			for (const auto& x : source) {
+				auto b = x->bounds(t0, t1);
+				if (!b.finite()) unbounded.push_back(x);
+				else refs.push_back(build_ref{ b, b.center(), x, x->dynamic() });
+			}
+			refit_mark.clear();
+			if (refs.empty()) return;
+			nodes.reserve(refs.size() * 2);
+			objs.reserve(refs.size());
+			build_node(refs, 0, refs.size(), no_parent, 0);
+			refit_mark.resize(nodes.size(), refit_epoch);
+		}
+
+		// get ready to trace rays with times in [t0, t1]
+		// the first call prepares every object and builds the tree, after that only the moving objects are
+		// prepared and the tree is refit around them, so the cost depends on how much moved, not on the size of the tree
+		void update(float t0, float t1) {
+			if (!prepared) {
+				for (const auto& o : source) o->prepare(t0, t1);
+				build(t0, t1);
+				prepared = true;
+				return;
+			}
+			for (const auto& o : dynamic_source) o->prepare(t0, t1);
+			refit(t0, t1);
+		}
+
+		aabb bounds() const {
+			if (!unbounded.empty()) return aabb::infinite();
+			if (nodes.empty()) return aabb();
+			return nodes[0].bounds;
+		}
+
+		// find the closest hit along r, same conventions as surfaces::surface::hit
+		bool hit(const ray& r, HR* hr) const {
+			if (hr == nullptr) return occluded(r, FLT_MAX);
+			bool hit = false;
+			for (const auto& o : unbounded)
+				hit = o->hit(r, hr) || hit;
+			if (nodes.empty()) return hit;
+
+			uint32 stack[bvh_stack_size]; uint32 sp = 0;
+			stack[sp++] = 0;
+			while (sp > 0) {
+				uint32 ni = stack[--sp];
+				const node& n = nodes[ni];
+				auto iv = n.bounds.hit_retint(r);
+				if (iv.second < glm::max(iv.first, 0.f) || iv.first > hr->t) continue;
+				if (n.count > 0) {
+					for (uint32 i = n.offset; i < n.offset + n.count; ++i)
+						hit = objs[i]->hit(r, hr) || hit;
+				}
+				else {
+					// push the farther child first so that the nearer one gets visited first
+					uint32 first = ni + 1;
+					if (r.d[n.axis] < 0.f) {
+						stack[sp++] = first;
+						stack[sp++] = n.offset;
+					}
+					else {
+						stack[sp++] = n.offset;
+						stack[sp++] = first;
+					}
+				}
+			}
+			return hit;
+		}
+
+		// check if anything is hit along r before tmax, stopping at the first hit found
+		bool occluded(const ray& r, float tmax) const {
+			for (const auto& o : unbounded)
+				if (o->occluded(r, tmax)) return true;
+			if (nodes.empty()) return false;
+
+			uint32 stack[bvh_stack_size]; uint32 sp = 0;
+			stack[sp++] = 0;
+			while (sp > 0) {
+				uint32 ni = stack[--sp];
+				const node& n = nodes[ni];
+				auto iv = n.bounds.hit_retint(r);
+				if (iv.second < glm::max(iv.first, 0.f) || iv.first > tmax) continue;
+				if (n.count > 0) {
+					for (uint32 i = n.offset; i < n.offset + n.count; ++i)
+						if (objs[i]->occluded(r, tmax)) return true;
+				}
+				else {
+					stack[sp++] = n.offset;
+					stack[sp++] = ni + 1;
+				}
+			}
+			return false;
+		}
+
+		// packet version of hit, tests the lanes in mask and returns the lanes whose hit record was updated
+		// a node is visited if any lane hits it, with the nearer child picked by the first active lane
+		template<typename HR4>
+		int hit4(const ray4& r, int mask, HR4& hr) const {
+			int hits = 0;
+			for (const auto& o : unbounded)
+				hits |= o->hit4(r, mask, hr);
+			if (nodes.empty() || mask == 0) return hits;
+
+			vec3x4 inv_d = vec3x4(float4(1.f) / r.d.x, float4(1.f) / r.d.y, float4(1.f) / r.d.z);
+			int lead = 0;
+			while (!(mask & (1 << lead))) lead++;
+			vec3 lead_d = r.d[lead];
+
+			uint32 stack[bvh_stack_size]; uint32 sp = 0;
+			stack[sp++] = 0;
+			while (sp > 0) {
+				uint32 ni = stack[--sp];
+				const node& n = nodes[ni];
+				int active = whrt5::hit4(n.bounds, r, inv_d, hr.t, mask);
+				if (active == 0) continue;
+				if (n.count > 0) {
+					for (uint32 i = n.offset; i < n.offset + n.count; ++i)
+						hits |= objs[i]->hit4(r, active, hr);
+				}
+				else {
+					uint32 first = ni + 1;
+					if (lead_d[n.axis] < 0.f) {
+						stack[sp++] = first;
+						stack[sp++] = n.offset;
+					}
+					else {
+						stack[sp++] = n.offset;
+						stack[sp++] = first;
+					}
+				}
+			}
+			return hits;
+		}
+
+		// packet version of occluded, returns the lanes in mask that hit something before tmax
+		int occluded4(const ray4& r, int mask, float4 tmax) const {
+			int occ = 0;
+			for (const auto& o : unbounded) {
+				occ |= o->occluded4(r, mask & ~occ, tmax);
+				if (occ == mask) return occ;
+			}
+			if (nodes.empty() || mask == 0) return occ;
+
+			vec3x4 inv_d = vec3x4(float4(1.f) / r.d.x, float4(1.f) / r.d.y, float4(1.f) / r.d.z);
+			uint32 stack[bvh_stack_size]; uint32 sp = 0;
+			stack[sp++] = 0;
+			while (sp > 0) {
+				uint32 ni = stack[--sp];
+				const node& n = nodes[ni];
+				int active = whrt5::hit4(n.bounds, r, inv_d, tmax, mask & ~occ);
+				if (active == 0) continue;
+				if (n.count > 0) {
+					for (uint32 i = n.offset; i < n.offset + n.count && active != 0; ++i) {
+						int o = objs[i]->occluded4(r, active, tmax);
+						occ |= o; active &= ~o;
+					}
+					if (occ == mask) return occ;
+				}
+				else {
+					stack[sp++] = n.offset;
+					stack[sp++] = ni + 1;
+				}
+			}
+			return occ;
+		}
+	};
+}
@@ -1,5 +1,6 @@
  #pragma once
 #include "cmmn.h"
+#include "sampler.h"
 
 namespace whrt5 {
 	class camera
@@ -20,18 +21,38 @@ namespace whrt5 {
 			up = 1.5f * normalize(cross(look, right));
 		}
 
-		inline ray generate_ray(vec2 uv, float t) const
+		// true if o generates the same rays as this camera, apart from their times
+		inline bool same_rays(const camera& o) const {
+			return pos == o.pos && look == o.look && up == o.up && right == o.right && w == o.w
+				&& lens_radius == o.lens_radius && focal_distance == o.focal_distance;
+		}
+
+		// the ray through uv at time t through lens position lu
+		inline ray lens_ray(vec2 uv, float t, vec2 lu) const
 		{
 			uv.y *= -1;
-			ray r(pos, normalize(w*look + uv.x*right + uv.y*up), t+shutter_length*rnd::randf());
+			ray r(pos, normalize(w*look + uv.x*right + uv.y*up), t);
 			if (lens_radius > 0.f) {
-				vec2 l = rnd::concentric_disk_sample(rnd::randf2())*lens_radius;
+				vec2 l = rnd::concentric_disk_sample(lu)*lens_radius;
 				vec3 pof = r(focal_distance / r.d.z);
 				r.e.xy += l;
 				r.d = normalize(pof - r.e);
 			}
 			return r;
 		}
+
+		// the shutter time and lens position are the next dimensions of smp
+		// if diff is set it gets the rays through uv + (duv.x, 0) and uv + (0, duv.y) at the same time and lens position
+		inline ray generate_ray(vec2 uv, float t, sample_cursor& smp, vec2 duv = vec2(0.f), ray_differentials* diff = nullptr) const
+		{
+			float rt = t + shutter_length*smp.get1d();
+			vec2 lu = smp.get2d();
+			if (diff != nullptr) {
+				diff->rx = lens_ray(uv + vec2(duv.x, 0.f), rt, lu);
+				diff->ry = lens_ray(uv + vec2(0.f, duv.y), rt, lu);
+			}
+			return lens_ray(uv, rt, lu);
+		}
 	};
 
 	/*
@@ -14,6 +14,9 @@
 #include <mutex>
 #include <queue>
 #include <memory>
+#include <cfloat>
+#include <cstdint>
+#include <cstring>
 using namespace std; //it's important to include as many symbols as possible
 
 #define GLM_FORCE_RADIANS
@@ -58,6 +61,11 @@ namespace whrt5 {
 		}
 	};
 
+	// the rays through the neighbouring pixels in x and y of a camera ray, used to estimate the ray's footprint
+	struct ray_differentials {
+		ray rx, ry;
+	};
+
 	// an Axis Aligned Bounding Box
 	struct aabb
 	{
@@ -77,12 +85,21 @@ namespace whrt5 {
 
 		// create an AABB that is the union of AABBs a and b
 		aabb(const aabb& a, const aabb& b)
-			: _min(), _max()
+			: _min(glm::min(a._min, b._min)), _max(glm::max(a._max, b._max))
 		{
-			add_point(a._min);
-			add_point(a._max);
-			add_point(b._min);
-			add_point(b._max);
+		}
+
+		// an AABB that contains everything, for objects that can't be bounded
+		static inline aabb infinite()
+		{
+			return aabb(vec3(-FLT_MAX), vec3(FLT_MAX));
+		}
+
+		// check to see if the AABB has finite extent on every axis
+		inline bool finite() const
+		{
+			return _min.x > -FLT_MAX && _min.y > -FLT_MAX && _min.z > -FLT_MAX &&
+				_max.x < FLT_MAX && _max.y < FLT_MAX && _max.z < FLT_MAX;
 		}
 
 		// extend the AABB to include point p
@@ -127,6 +144,7 @@ namespace whrt5 {
 		// transform AABB by matrix to obtain new AABB
 		inline aabb transform(const mat4& m) const
 		{
+			if (!finite()) return *this;
 			vec3 min, max;
 			min = vec3(m[3][0], m[3][1], m[3][2]);
 			max = min;
@@ -216,35 +234,88 @@ namespace whrt5 {
 		}
 	};
 
+	// place a local space box at a position, for bounding things moved by an animated<vec3>
+	inline aabb place(const aabb& b, const vec3& p) {
+		return aabb(b._min + p, b._max + p);
+	}
+	// place a local space box by a transform, for bounding things moved by an animated<mat4>
+	inline aabb place(const aabb& b, const mat4& m) {
+		return b.transform(m);
+	}
+
 	template<typename T>
 	struct animated {
 		function<T(float)> F;
 		T cv;
 		bool const_val;
+		// optional exact bound of a local space box placed by this value at any time in [t0, t1]
+		function<aabb(const aabb&, float, float)> bound;
 		animated(T t) : cv(t), const_val(true), F([t](float) {return t; }) {}
 		template<typename Func>
 		animated(Func f) : F(f), const_val(false) {}
+		template<typename Func, typename BoundFunc>
+		animated(Func f, BoundFunc b) : F(f), const_val(false), bound(b) {}
 
 		T operator()(float t) const { return const_val ? cv : F(t); }
+
+		// bound the local space box b placed by this value at any time in [t0, t1]
+		// without a bound callback the interval is sampled, and the result is padded by half of the
+		// largest distance the box moved between two samples to cover the motion in between them
+		aabb bounds(const aabb& b, float t0, float t1, uint32 samples = 16) const {
+			if (const_val) return place(b, cv);
+			if (bound) return bound(b, t0, t1);
+			aabb last = place(b, F(t0));
+			if (t1 <= t0 || !last.finite()) return last;
+			aabb r = last; float pad = 0.f;
+			for (uint32 i = 1; i <= samples; ++i) {
+				aabb s = place(b, F(mix(t0, t1, (float)i / (float)samples)));
+				vec3 d = glm::max(abs(s._min - last._min), abs(s._max - last._max));
+				pad = glm::max(pad, glm::max(d.x, glm::max(d.y, d.z)));
+				r.add_aabb(s); last = s;
+			}
+			return aabb(r._min - pad*.5f, r._max + pad*.5f);
+		}
 	};
 	
 	namespace rnd {
-		//static mt19937 RNG;
-		static minstd_rand RNG = minstd_rand(random_device()());
-
-		inline int randi(int min, int max) {
-			uniform_int_distribution<int> dist(min, max);
-			return dist(RNG);
+		/*
+			counter based random numbers: each value is a hash of (frame, pixel, sample, dimension) instead of the
+			next state of a shared generator, so threads never touch the same state and rerunning a render gives
+			exactly the same image
+			the samplers make a stream for each pixel sample and take its dimensions with at() or next()
+		*/
+
+		// splitmix64 finalizer
+		inline uint64_t mix(uint64_t x) {
+			x ^= x >> 30; x *= 0xbf58476d1ce4e5b9ull;
+			x ^= x >> 27; x *= 0x94d049bb133111ebull;
+			return x ^ (x >> 31);
 		}
 
-		inline float randf() {
-			uniform_real_distribution<float> dist;
-			return dist(RNG);
+		struct stream {
+			uint64_t key;
+			uint32 dim;
+
+			stream() : key(0), dim(0) {}
+			stream(uint32 frame, uvec2 px, uint32 sample)
+				: key(mix(mix(mix(mix((uint64_t)frame) ^ px.x) ^ ((uint64_t)px.y << 32)) ^ sample)), dim(0) {}
+
+			// the value for dimension d of this sample, doesn't advance the stream
+			inline uint32 at(uint32 d) const {
+				return (uint32)(mix(key ^ (((uint64_t)d + 1) * 0x9e3779b97f4a7c15ull)) >> 32);
+			}
+			inline uint32 next() { return at(dim++); }
+		};
+
+		// frame key for time t, so every frame of an animation gets its own numbers
+		inline uint32 frame_key(float t) {
+			uint32 k;
+			memcpy(&k, &t, sizeof(k));
+			return k;
 		}
 
-		inline vec2 randf2() {
-			uniform_real_distribution<float> D;
-			return vec2(D(RNG), D(RNG));
+		inline float to_unit(uint32 x) {
+			return (float)(x >> 8) * (1.f / 16777216.f);
 		}
 
 		inline vec2 concentric_disk_sample(vec2 u) {
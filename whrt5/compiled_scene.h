@@ -0,0 +1,384 @@
+#pragma once
+#include "cmmn.h"
+#include "packet.h"
+#include "surface.h"
+#include "primitive.h"
+#include <limits>
+
+namespace whrt5 {
+	/*
+		compiled scenes
+		the static spheres, boxes, disks and cylinders of a scene are copied out of their surface_primitives into
+		small batches that store each kind of shape as structure of arrays, so that one ray is tested against
+		4 shapes at a time with no virtual calls or pointers to chase. the batches are sorted along a Morton curve
+		so that each one is spatially compact, and a BVH is built over them and everything that couldn't be compiled
+	*/
+	namespace compiled {
+		// number of shapes in a batch
+		const uint32 batch_size = 16;
+
+		// rays as components across float4s, either one ray splatted across every lane or a packet with a ray per lane
+		struct splat_ray {
+			float4 ex, ey, ez, dx, dy, dz;
+			splat_ray(const ray& r)
+				: ex(r.e.x), ey(r.e.y), ez(r.e.z), dx(r.d.x), dy(r.d.y), dz(r.d.z) {}
+			splat_ray(const ray4& r)
+				: ex(r.e.x), ey(r.e.y), ez(r.e.z), dx(r.d.x), dy(r.d.y), dz(r.d.z) {}
+		};
+
+		/*
+			shape arrays
+			each one can set and pad entry i, intersect a splat ray with entries [i, i+4) or the 4 rays of a packet
+			with entry i, returning a lane mask and t, fill in the normal and texture coordinates of entry i at point p,
+			and bound entry i. both intersections go through the same test with the shapes in the lanes or splatted
+			padding entries are NaN so that every comparison against them fails
+		*/
+
+		struct sphere_array {
+			alignas(16) float cx[batch_size], cy[batch_size], cz[batch_size], r2[batch_size];
+
+			void set(uint32 i, const surfaces::sphere& s) {
+				cx[i] = s.center.cv.x; cy[i] = s.center.cv.y; cz[i] = s.center.cv.z;
+				r2[i] = s.radius*s.radius;
+			}
+			void pad(uint32 i) {
+				cx[i] = cy[i] = cz[i] = r2[i] = numeric_limits<float>::quiet_NaN();
+			}
+
+			static inline float4 test(const splat_ray& r, float4 x, float4 y, float4 z, float4 rr, float4& t) {
+				float4 vx = r.ex - x, vy = r.ey - y, vz = r.ez - z;
+				float4 b = -(vx*r.dx + vy*r.dy + vz*r.dz);
+				float4 det = b*b - (vx*vx + vy*vy + vz*vz) + rr;
+				float4 sq = vsqrt(vmax(det, float4(0.f)));
+				float4 zero = float4(0.f);
+				t = b - sq;
+				return (det >= zero) & (t > zero) & (b + sq > zero);
+			}
+			inline float4 intersect(const splat_ray& r, uint32 i, float4& t) const {
+				return test(r, float4::load(cx + i), float4::load(cy + i), float4::load(cz + i), float4::load(r2 + i), t);
+			}
+			inline float4 intersect_packet(const splat_ray& r, uint32 i, float4& t) const {
+				return test(r, float4(cx[i]), float4(cy[i]), float4(cz[i]), float4(r2[i]), t);
+			}
+
+			inline void attributes(uint32 i, vec3 p, hit_record* hr) const {
+				hr->norm = normalize(p - vec3(cx[i], cy[i], cz[i]));
+				hr->texc = surfaces::sphere::texcoord(hr->norm);
+				surfaces::sphere::texgrad(hr->norm, sqrt(r2[i]), hr->dudp, hr->dvdp);
+			}
+
+			inline aabb bounds(uint32 i) const {
+				vec3 c = vec3(cx[i], cy[i], cz[i]);
+				return aabb(c - sqrt(r2[i]), c + sqrt(r2[i]));
+			}
+		};
+
+		struct box_array {
+			alignas(16) float minx[batch_size], miny[batch_size], minz[batch_size];
+			alignas(16) float maxx[batch_size], maxy[batch_size], maxz[batch_size];
+
+			void set(uint32 i, const surfaces::box& b) {
+				minx[i] = b._min.x; miny[i] = b._min.y; minz[i] = b._min.z;
+				maxx[i] = b._max.x; maxy[i] = b._max.y; maxz[i] = b._max.z;
+			}
+			void pad(uint32 i) {
+				minx[i] = miny[i] = minz[i] = maxx[i] = maxy[i] = maxz[i] = numeric_limits<float>::quiet_NaN();
+			}
+
+			static inline float4 test(const splat_ray& r, const vec3x4& mn, const vec3x4& mx, float4& t) {
+				float4 one = float4(1.f);
+				float4 idx = one / r.dx, idy = one / r.dy, idz = one / r.dz;
+				float4 t1x = (mn.x - r.ex) * idx, t2x = (mx.x - r.ex) * idx;
+				float4 t1y = (mn.y - r.ey) * idy, t2y = (mx.y - r.ey) * idy;
+				float4 t1z = (mn.z - r.ez) * idz, t2z = (mx.z - r.ez) * idz;
+				t = vmax(vmax(vmin(t1x, t2x), vmin(t1y, t2y)), vmin(t1z, t2z));
+				float4 tfar = vmin(vmin(vmax(t1x, t2x), vmax(t1y, t2y)), vmax(t1z, t2z));
+				return (tfar >= t) & (t >= float4(0.f));
+			}
+			inline float4 intersect(const splat_ray& r, uint32 i, float4& t) const {
+				return test(r, vec3x4(float4::load(minx + i), float4::load(miny + i), float4::load(minz + i)),
+					vec3x4(float4::load(maxx + i), float4::load(maxy + i), float4::load(maxz + i)), t);
+			}
+			inline float4 intersect_packet(const splat_ray& r, uint32 i, float4& t) const {
+				return test(r, vec3x4(vec3(minx[i], miny[i], minz[i])), vec3x4(vec3(maxx[i], maxy[i], maxz[i])), t);
+			}
+
+			inline void attributes(uint32 i, vec3 p, hit_record* hr) const {
+				vec3 mn = vec3(minx[i], miny[i], minz[i]), mx = vec3(maxx[i], maxy[i], maxz[i]);
+				surfaces::box((mn + mx)*.5f, (mx - mn)*.5f).attributes(p, hr);
+			}
+
+			inline aabb bounds(uint32 i) const {
+				return aabb(vec3(minx[i], miny[i], minz[i]), vec3(maxx[i], maxy[i], maxz[i]));
+			}
+		};
+
+		struct disk_array {
+			alignas(16) float cx[batch_size], cy[batch_size], cz[batch_size];
+			alignas(16) float nx[batch_size], ny[batch_size], nz[batch_size], r2[batch_size];
+
+			void set(uint32 i, const surfaces::disk& d) {
+				cx[i] = d.center.x; cy[i] = d.center.y; cz[i] = d.center.z;
+				nx[i] = d.norm.x; ny[i] = d.norm.y; nz[i] = d.norm.z;
+				r2[i] = d.radius*d.radius;
+			}
+			void pad(uint32 i) {
+				cx[i] = cy[i] = cz[i] = nx[i] = ny[i] = nz[i] = r2[i] = numeric_limits<float>::quiet_NaN();
+			}
+
+			static inline float4 test(const splat_ray& r, const vec3x4& c, const vec3x4& n, float4 rr, float4& t) {
+				float4 D = n.x*r.dx + n.y*r.dy + n.z*r.dz;
+				t = ((c.x - r.ex)*n.x + (c.y - r.ey)*n.y + (c.z - r.ez)*n.z) / D;
+				float4 px = r.ex + r.dx*t - c.x, py = r.ey + r.dy*t - c.y, pz = r.ez + r.dz*t - c.z;
+				return (vabs(D) > float4(0.000001f)) & (t > float4(0.f)) & (px*px + py*py + pz*pz <= rr);
+			}
+			inline float4 intersect(const splat_ray& r, uint32 i, float4& t) const {
+				return test(r, vec3x4(float4::load(cx + i), float4::load(cy + i), float4::load(cz + i)),
+					vec3x4(float4::load(nx + i), float4::load(ny + i), float4::load(nz + i)), float4::load(r2 + i), t);
+			}
+			inline float4 intersect_packet(const splat_ray& r, uint32 i, float4& t) const {
+				return test(r, vec3x4(vec3(cx[i], cy[i], cz[i])), vec3x4(vec3(nx[i], ny[i], nz[i])), float4(r2[i]), t);
+			}
+
+			inline void attributes(uint32 i, vec3 p, hit_record* hr) const {
+				hr->norm = vec3(nx[i], ny[i], nz[i]);
+				hr->texc = cross(p, hr->norm).xz;
+				surfaces::planar_texgrad(hr->norm, hr->dudp, hr->dvdp);
+			}
+
+			inline aabb bounds(uint32 i) const {
+				return surfaces::disk(vec3(cx[i], cy[i], cz[i]), sqrt(r2[i]), vec3(nx[i], ny[i], nz[i])).bounds(0.f, 0.f);
+			}
+		};
+
+		struct cylinder_array {
+			alignas(16) float r2[batch_size], height[batch_size];
+
+			void set(uint32 i, const surfaces::cylinder& c) {
+				r2[i] = c.radius*c.radius; height[i] = c.height;
+			}
+			void pad(uint32 i) {
+				r2[i] = height[i] = numeric_limits<float>::quiet_NaN();
+			}
+
+			static inline float4 test(const splat_ray& r, float4 rr, float4 h, float4& t) {
+				float4 two = float4(2.f), zero = float4(0.f);
+				float4 I1 = two * (r.ex*r.dx + r.ez*r.dz);
+				float4 denm = two * (r.dx*r.dx + r.dz*r.dz);
+				float4 det = I1*I1 - two*denm*(r.ex*r.ex + r.ez*r.ez - rr);
+				float4 sq = vsqrt(vmax(det, zero));
+				float4 t1 = (sq - I1) / denm, t2 = (-sq - I1) / denm;
+				float4 y1 = r.ey + r.dy*t1, y2 = r.ey + r.dy*t2;
+				// the nearest root in front of the ray and within the height, like surfaces::cylinder
+				float4 ok1 = (t1 > zero) & (y1 >= zero) & (y1 <= h);
+				float4 ok2 = (t2 > zero) & (y2 >= zero) & (y2 <= h);
+				t = vmin(select(ok1, t1, float4(FLT_MAX)), select(ok2, t2, float4(FLT_MAX)));
+				return (det >= zero) & (ok1 | ok2);
+			}
+			inline float4 intersect(const splat_ray& r, uint32 i, float4& t) const {
+				return test(r, float4::load(r2 + i), float4::load(height + i), t);
+			}
+			inline float4 intersect_packet(const splat_ray& r, uint32 i, float4& t) const {
+				return test(r, float4(r2[i]), float4(height[i]), t);
+			}
+
+			inline void attributes(uint32, vec3 p, hit_record* hr) const {
+				hr->norm = normalize(vec3(p.x, 0.01f, p.z));
+				hr->texc = vec2(atan(p.z / p.x), p.y);
+				surfaces::cylinder::texgrad(p, hr->dudp, hr->dvdp);
+			}
+
+			inline aabb bounds(uint32 i) const {
+				float r = sqrt(r2[i]);
+				return aabb(vec3(-r, 0.f, -r), vec3(r, height[i], r));
+			}
+		};
+
+		// up to batch_size shapes of one kind, tested 4 at a time against single rays and one at a time against packets
+		template<typename Shapes>
+		struct batch : public primitive {
+			Shapes shapes;
+			shared_ptr<material> mat[batch_size];
+			uint32 count;
+			aabb box;
+
+			// index of the closest shape hit before tmax, which is moved to the hit, or -1 if nothing was hit
+			inline int closest(const ray& r, float& tmax) const {
+				splat_ray sr(r);
+				int best = -1;
+				for (uint32 i = 0; i < count; i += packet_width) {
+					// t is only written by intersect, so it has to run before t is compared
+					float4 t, h = shapes.intersect(sr, i, t);
+					int m = movemask(h & (t <= float4(tmax)));
+					for (int l = 0; m != 0; ++l, m >>= 1) {
+						if ((m & 1) && t[l] <= tmax) {
+							tmax = t[l]; best = (int)i + l;
+						}
+					}
+				}
+				return best;
+			}
+
+			bool hit(const ray& r, hit_record* hr) const override {
+				if (hr == nullptr) return occluded(r, FLT_MAX);
+				float t = hr->t;
+				int i = closest(r, t);
+				if (i < 0) return false;
+				hr->t = t;
+				shapes.attributes(i, r(t), hr);
+				hr->mat = mat[i];
+				return true;
+			}
+
+			bool occluded(const ray& r, float tmax) const override {
+				splat_ray sr(r);
+				for (uint32 i = 0; i < count; i += packet_width) {
+					float4 t, h = shapes.intersect(sr, i, t);
+					if (movemask(h & (t < float4(tmax)))) return true;
+				}
+				return false;
+			}
+
+			// packets go the other way around, the 4 rays are tested against one shape at a time
+			int hit4(const ray4& r, int mask, hit_record4& hr) const override {
+				splat_ray sr(r);
+				float4 active = lane_mask(mask), tmax = hr.t;
+				int best[packet_width] = { -1, -1, -1, -1 };
+				int hits = 0;
+				for (uint32 i = 0; i < count; ++i) {
+					float4 t, h = shapes.intersect_packet(sr, i, t);
+					h = h & (t <= tmax) & active;
+					int m = movemask(h);
+					if (m == 0) continue;
+					tmax = select(h, t, tmax);
+					for (int l = 0; l < packet_width; ++l)
+						if (m & (1 << l)) best[l] = (int)i;
+					hits |= m;
+				}
+				if (hits == 0) return 0;
+				vec3x4 p = r(tmax);
+				for (int l = 0; l < packet_width; ++l) {
+					if (!(hits & (1 << l))) continue;
+					hit_record h; h.t = tmax[l];
+					shapes.attributes(best[l], p[l], &h);
+					// the material is taken straight from mat so h never holds a copy of the shared_ptr
+					static_cast<surfaces::hit_record4&>(hr).set_lane(l, h);
+					hr.mat[l] = mat[best[l]].get();
+				}
+				return hits;
+			}
+
+			int occluded4(const ray4& r, int mask, float4 tmax) const override {
+				splat_ray sr(r);
+				int occ = 0;
+				for (uint32 i = 0; i < count && occ != mask; ++i) {
+					float4 t, h = shapes.intersect_packet(sr, i, t);
+					occ |= movemask(h & (t < tmax)) & mask;
+				}
+				return occ;
+			}
+
+			aabb bounds(float, float) const override {
+				return box;
+			}
+		};
+
+		// spread the low 10 bits of x out so that there are two zero bits between each one
+		inline uint32 spread_bits3(uint32 x) {
+			x &= 0x3ff;
+			x = (x | (x << 16)) & 0x030000ff;
+			x = (x | (x << 8)) & 0x0300f00f;
+			x = (x | (x << 4)) & 0x030c30c3;
+			x = (x | (x << 2)) & 0x09249249;
+			return x;
+		}
+
+		// 30 bit Morton code of p inside the box b
+		inline uint32 morton3(vec3 p, const aabb& b) {
+			vec3 q = clamp((p - b._min) / glm::max(b.extents(), vec3(1e-6f)), vec3(0.f), vec3(1.f)) * 1023.f;
+			return spread_bits3((uint32)q.x) | (spread_bits3((uint32)q.y) << 1) | (spread_bits3((uint32)q.z) << 2);
+		}
+
+		// static shapes of one kind waiting to be batched
+		template<typename Shape>
+		struct shape_list {
+			vector<pair<shared_ptr<Shape>, shared_ptr<material>>> shapes;
+
+			// sort the shapes along a Morton curve and cut them into batches
+			template<typename Shapes>
+			void make_batches(vector<shared_ptr<primitive>>& out) const {
+				if (shapes.empty()) return;
+				aabb scene_box = shapes[0].first->bounds(0.f, 0.f);
+				for (const auto& s : shapes) scene_box.add_aabb(s.first->bounds(0.f, 0.f));
+				vector<pair<uint32, size_t>> order;
+				for (size_t i = 0; i < shapes.size(); ++i)
+					order.push_back(make_pair(morton3(shapes[i].first->bounds(0.f, 0.f).center(), scene_box), i));
+				sort(order.begin(), order.end());
+				for (size_t i = 0; i < order.size(); i += batch_size) {
+					auto b = make_shared<batch<Shapes>>();
+					b->count = 0;
+					for (size_t j = i; j < order.size() && j < i + batch_size; ++j) {
+						const auto& s = shapes[order[j].second];
+						b->shapes.set(b->count, *s.first);
+						b->mat[b->count] = s.second;
+						b->box = b->count == 0 ? b->shapes.bounds(0) : aabb(b->box, b->shapes.bounds(b->count));
+						b->count++;
+					}
+					// round up to whole float4s and pad the rest so the last loads never hit anything
+					uint32 padded = (b->count + packet_width - 1) / packet_width * packet_width;
+					for (uint32 j = b->count; j < padded; ++j) b->shapes.pad(j);
+					b->count = padded;
+					out.push_back(b);
+				}
+			}
+		};
+
+		struct scene_lists {
+			shape_list<surfaces::sphere> spheres;
+			shape_list<surfaces::box> boxes;
+			shape_list<surfaces::disk> disks;
+			shape_list<surfaces::cylinder> cylinders;
+			vector<shared_ptr<primitive>> rest;
+
+			// sort o into the shape lists, going into groups
+			void add(const shared_ptr<primitive>& o) {
+				if (auto g = dynamic_pointer_cast<pgroup>(o)) {
+					for (const auto& c : g->objs) add(c);
+					return;
+				}
+				if (auto g = dynamic_pointer_cast<bvh_primitive>(o)) {
+					for (const auto& c : g->tree.objects()) add(c);
+					return;
+				}
+				auto sp = dynamic_pointer_cast<surface_primitive>(o);
+				if (sp && !sp->dynamic()) {
+					if (auto s = dynamic_pointer_cast<surfaces::sphere>(sp->surf)) {
+						spheres.shapes.push_back(make_pair(s, sp->mat)); return;
+					}
+					if (auto s = dynamic_pointer_cast<surfaces::box>(sp->surf)) {
+						boxes.shapes.push_back(make_pair(s, sp->mat)); return;
+					}
+					if (auto s = dynamic_pointer_cast<surfaces::disk>(sp->surf)) {
+						disks.shapes.push_back(make_pair(s, sp->mat)); return;
+					}
+					if (auto s = dynamic_pointer_cast<surfaces::cylinder>(sp->surf)) {
+						cylinders.shapes.push_back(make_pair(s, sp->mat)); return;
+					}
+				}
+				rest.push_back(o);
+			}
+		};
+	}
+
+	// compile a scene made of objs into shape batches under a BVH, anything that can't be batched is kept as it is
+	inline shared_ptr<primitive> compile_scene(const vector<shared_ptr<primitive>>& objs) {
+		compiled::scene_lists lists;
+		for (const auto& o : objs) lists.add(o);
+		vector<shared_ptr<primitive>> top = lists.rest;
+		lists.spheres.make_batches<compiled::sphere_array>(top);
+		lists.boxes.make_batches<compiled::box_array>(top);
+		lists.disks.make_batches<compiled::disk_array>(top);
+		lists.cylinders.make_batches<compiled::cylinder_array>(top);
+		return make_shared<bvh_primitive>(top);
+	}
+}
@@ -0,0 +1,200 @@
+#include "frame_sink.h"
+#include <iomanip>
+
+#ifdef _WIN32
+#include <io.h>
+#include <fcntl.h>
+#endif
+
+namespace whrt5 {
+	namespace sinks {
+		segmented_theora::segmented_theora(const string& filename, uvec2 frame_size, pair<uint32, uint32> fps,
+			uint32 segment_length, uint32 encoder_count)
+			: size(frame_size), fps(fps), segment_length(glm::max(1u, segment_length)), serial_base(rand()),
+			  free_frames((encoder_count + 1)*glm::max(1u, segment_length)), segments(encoder_count),
+			  submitted(0), next_out(0), failed(false)
+		{
+			if (fopen_s(&of, filename.c_str(), "wb") != 0 || of == nullptr)
+				throw runtime_error("couldn't open file " + filename);
+			uint32 frame_count = (encoder_count + 1)*this->segment_length;
+			for (uint32 i = 0; i < frame_count; ++i) {
+				frame_store.push_back(unique_ptr<ycbcr_frame>(new ycbcr_frame(video::padded_size(size))));
+				free_frames.push(frame_store.back().get());
+			}
+			current.index = 0;
+			for (uint32 i = 0; i < encoder_count; ++i) {
+				encoders.push_back(thread([this]() {
+					while (true) {
+						segment s = segments.pop();
+						if (s.index == stop) return;
+						encode(s);
+					}
+				}));
+			}
+		}
+
+		segmented_theora::~segmented_theora() {
+			try { flush(); }
+			catch (...) {}
+			for (size_t i = 0; i < encoders.size(); ++i) {
+				segment s; s.index = stop;
+				segments.push(s);
+			}
+			for (auto& t : encoders) t.join();
+			fclose(of);
+		}
+
+		void segmented_theora::encode(segment& s) {
+			FILE* tf = nullptr;
+			if (!failed) {
+				try {
+					tf = tmpfile();
+					if (tf == nullptr) throw runtime_error("couldn't create a temporary file for a video segment");
+					video v(tf, size, fps, serial_base + (int)s.index);
+					for (size_t i = 0; i < s.frames.size(); ++i)
+						v.write_frame(s.frames[i]->planes, i + 1 == s.frames.size());
+				}
+				catch (...) {
+					lock_guard<mutex> lk(out_mutex);
+					if (!error) error = current_exception();
+					failed = true;
+				}
+			}
+			for (auto f : s.frames) free_frames.push(f);
+			append(s.index, tf);
+		}
+
+		// write segments to the file as soon as all the ones before them are there
+		void segmented_theora::append(uint32 index, FILE* f) {
+			lock_guard<mutex> lk(out_mutex);
+			finished[index] = f;
+			for (auto n = finished.find(next_out); n != finished.end(); n = finished.find(next_out)) {
+				if (n->second != nullptr) {
+					if (!failed) {
+						rewind(n->second);
+						char buf[1 << 16];
+						size_t len;
+						while ((len = fread(buf, 1, sizeof(buf), n->second)) > 0) {
+							if (fwrite(buf, 1, len, of) != len) {
+								if (!error) error = make_exception_ptr(runtime_error("couldn't write video segment"));
+								failed = true;
+								break;
+							}
+						}
+					}
+					fclose(n->second);
+				}
+				finished.erase(n);
+				next_out++;
+			}
+			written.notify_all();
+		}
+
+		void segmented_theora::submit() {
+			if (current.frames.empty()) return;
+			uint32 index = current.index;
+			segments.push(move(current));
+			current = segment();
+			current.index = index + 1;
+			submitted++;
+		}
+
+		void segmented_theora::check_error() {
+			if (failed) {
+				lock_guard<mutex> lk(out_mutex);
+				rethrow_exception(error);
+			}
+		}
+
+		void segmented_theora::write_frame(const texture2d& tx, uint32, bool last) {
+			check_error();
+			ycbcr_frame* f = free_frames.pop();
+			f->convert(tx);
+			current.frames.push_back(f);
+			if (current.frames.size() == segment_length || last) submit();
+		}
+
+		void segmented_theora::flush() {
+			submit();
+			{
+				unique_lock<mutex> lk(out_mutex);
+				written.wait(lk, [&]() { return next_out == submitted; });
+			}
+			fflush(of);
+			check_error();
+		}
+
+		y4m::y4m(const string& filename, uvec2 frame_size, pair<uint32, uint32> fps, thread_pool* conversion_pool)
+			: size(frame_size), frame(uvec2((frame_size.x + 1) & ~1u, (frame_size.y + 1) & ~1u)), pool(conversion_pool)
+		{
+			if (filename.empty() || filename == "-") {
+#ifdef _WIN32
+				_setmode(_fileno(stdout), _O_BINARY);
+#endif
+				of = stdout;
+				own_file = false;
+			}
+			else {
+				if (fopen_s(&of, filename.c_str(), "wb") != 0 || of == nullptr)
+					throw runtime_error("couldn't open file " + filename);
+				own_file = true;
+			}
+			ostringstream header;
+			header << "YUV4MPEG2 W" << size.x << " H" << size.y << " F" << fps.first << ":" << fps.second
+				<< " Ip A1:1 C420jpeg\n";
+			string h = header.str();
+			write(h.data(), h.size());
+		}
+
+		y4m::~y4m() {
+			fflush(of);
+			if (own_file) fclose(of);
+		}
+
+		void y4m::write(const void* data, size_t len) {
+			if (fwrite(data, 1, len, of) != len)
+				throw runtime_error("couldn't write YUV4MPEG2 stream");
+		}
+
+		void y4m::write_frame(const texture2d& tx, uint32, bool last) {
+			frame.convert(tx, pool);
+			write("FRAME\n", 6);
+			for (uint32 y = 0; y < size.y; ++y)
+				write(frame.planes[0].data + y*frame.planes[0].stride, size.x);
+			for (int p = 1; p < 3; ++p)
+				for (int y = 0; y < frame.planes[p].height; ++y)
+					write(frame.planes[p].data + y*frame.planes[p].stride, frame.planes[p].width);
+			if (last) flush();
+		}
+
+		void y4m::flush() {
+			fflush(of);
+		}
+
+		void image_sequence::write_frame(const texture2d& tx, uint32 i, bool) {
+			ostringstream fn;
+			fn << prefix << setw(5) << setfill('0') << i << ".bmp";
+			tx.write_bmp(fn.str());
+		}
+	}
+
+	static bool ends_with(const string& s, const string& e) {
+		return s.size() >= e.size() && s.compare(s.size() - e.size(), e.size(), e) == 0;
+	}
+
+	unique_ptr<frame_sink> make_sink(const string& target, uvec2 frame_size, pair<uint32, uint32> fps) {
+		if (target == "-")
+			return unique_ptr<frame_sink>(new sinks::y4m(target, frame_size, fps));
+		if (target.compare(0, 5, "pipe:") == 0)
+			return unique_ptr<frame_sink>(new sinks::y4m(target.substr(5), frame_size, fps));
+		if (ends_with(target, ".y4m"))
+			return unique_ptr<frame_sink>(new sinks::y4m(target, frame_size, fps));
+		if (target.compare(0, 10, "segmented:") == 0)
+			return unique_ptr<frame_sink>(new sinks::segmented_theora(target.substr(10), frame_size, fps));
+		if (ends_with(target, ".ogg") || ends_with(target, ".ogv"))
+			return unique_ptr<frame_sink>(new sinks::theora(target, frame_size, fps));
+		if (ends_with(target, ".bmp"))
+			return unique_ptr<frame_sink>(new sinks::image_sequence(target.substr(0, target.size() - 4)));
+		throw runtime_error("don't know how to write frames to " + target);
+	}
+}
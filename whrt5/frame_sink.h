@@ -0,0 +1,126 @@
+#pragma once
+#include "cmmn.h"
+#include "texture.h"
+#include "video.h"
+#include "pipeline.h"
+#include <atomic>
+
+namespace whrt5 {
+	/*
+		somewhere for rendered frames to go
+		frames are written in order, from one thread at a time. the renderer hands them to a sink from the encoder
+		thread of a render_pipeline, so a slow sink only limits throughput when it is slower than rendering
+	*/
+	class frame_sink {
+	public:
+		virtual ~frame_sink() {}
+		// write frame i, last is true for the final frame
+		virtual void write_frame(const texture2d& tx, uint32 i, bool last) = 0;
+		// write out anything that is buffered
+		virtual void flush() {}
+	};
+
+	namespace sinks {
+		// Ogg Theora file
+		class theora : public frame_sink {
+			video v;
+		public:
+			theora(const string& filename, uvec2 frame_size, pair<uint32, uint32> fps, thread_pool* conversion_pool = nullptr)
+				: v(filename, frame_size, fps, conversion_pool) {}
+
+			void write_frame(const texture2d& tx, uint32, bool last) override { v.write_frame(tx, last); }
+			void flush() override { v.flush(); }
+		};
+
+		/*
+			Ogg Theora file encoded in parallel: frames are split into segments of segment_length frames and each
+			segment is encoded as its own Theora stream by one of encoder_count threads. the finished streams are
+			appended to the file in order, which makes it a chained Ogg file
+			frames are converted to Y'CbCr as they arrive and wait in that form, so the memory used is about
+			(encoder_count + 1) * segment_length frames at 12 bits per pixel
+		*/
+		class segmented_theora : public frame_sink {
+			struct segment {
+				uint32 index;
+				vector<ycbcr_frame*> frames;
+			};
+			static const uint32 stop = ~0u;
+
+			FILE* of;
+			uvec2 size;
+			pair<uint32, uint32> fps;
+			uint32 segment_length;
+			int serial_base;
+
+			vector<unique_ptr<ycbcr_frame>> frame_store;
+			bounded_queue<ycbcr_frame*> free_frames;
+			bounded_queue<segment> segments;
+			segment current;
+			uint32 submitted;
+			vector<thread> encoders;
+
+			// finished segments waiting for the ones before them, as temporary files
+			mutex out_mutex;
+			condition_variable written;
+			map<uint32, FILE*> finished;
+			uint32 next_out;
+			exception_ptr error;
+			atomic<bool> failed;
+
+			void encode(segment& s);
+			void append(uint32 index, FILE* f);
+			void submit();
+			void check_error();
+		public:
+			segmented_theora(const string& filename, uvec2 frame_size, pair<uint32, uint32> fps,
+				uint32 segment_length = 60, uint32 encoder_count = glm::max(1u, thread::hardware_concurrency() / 2));
+			~segmented_theora();
+
+			void write_frame(const texture2d& tx, uint32 i, bool last) override;
+			// encode everything written so far and wait until it is in the file
+			void flush() override;
+		};
+
+		/*
+			uncompressed YUV4MPEG2 stream, for handing frames to an external encoder
+			it can go to a file, a named pipe or a FIFO (anything fopen can open for writing), or to stdout
+		*/
+		class y4m : public frame_sink {
+			FILE* of;
+			bool own_file;
+			uvec2 size;
+			ycbcr_frame frame;
+			thread_pool* pool;
+
+			void write(const void* data, size_t len);
+		public:
+			// an empty filename or "-" writes to stdout
+			y4m(const string& filename, uvec2 frame_size, pair<uint32, uint32> fps, thread_pool* conversion_pool = nullptr);
+			~y4m();
+
+			void write_frame(const texture2d& tx, uint32 i, bool last) override;
+			void flush() override;
+		};
+
+		// one BMP file per frame, named prefix + 5 digit frame number + ".bmp"
+		class image_sequence : public frame_sink {
+			string prefix;
+		public:
+			image_sequence(const string& prefix) : prefix(prefix) {}
+
+			void write_frame(const texture2d& tx, uint32 i, bool last) override;
+		};
+	}
+
+	/*
+		pick a sink for an output target:
+			-					YUV4MPEG2 to stdout
+			pipe:name			YUV4MPEG2 to the named pipe or FIFO called name
+			*.y4m				YUV4MPEG2 file
+			*.ogg, *.ogv		Ogg Theora file
+			segmented:*.ogg		Ogg Theora file encoded in parallel segments, as a chained Ogg file
+			*.bmp				BMP sequence, frame.bmp becomes frame00000.bmp, frame00001.bmp, ...
+		throws runtime_error for anything else
+	*/
+	unique_ptr<frame_sink> make_sink(const string& target, uvec2 frame_size, pair<uint32, uint32> fps);
+}
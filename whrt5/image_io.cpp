@@ -0,0 +1,277 @@
+#include "image_io.h"
+#include "mapped_file.h"
+#include "thread_pool.h"
+#include "packet.h"
+#include <cctype>
+
+namespace whrt5 {
+	static inline uint32 read_u16(const uint8_t* p) { return p[0] | (p[1] << 8); }
+	static inline uint32 read_u32(const uint8_t* p) { return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32)p[3] << 24); }
+
+	// run f(y) for each row of an image, spread over the global thread pool in bands of rows
+	static void for_rows(uint32 height, const function<void(uint32)>& f) {
+		const uint32 band = 16;
+		thread_pool::global().parallel_for((height + band - 1) / band, [&](uint32 i) {
+			for (uint32 y = i*band; y < glm::min(height, (i + 1)*band); ++y) f(y);
+		});
+	}
+
+	// the words at p, p + 3, p + 6 and p + 9 for 3 byte pixels or the 4 words at p for 4 byte pixels
+	// 16 bytes from p must be readable either way
+	static inline __m128i gather_pixels4(const uint8_t* p, uint32 bpp) {
+		__m128i v = _mm_loadu_si128((const __m128i*)p);
+		if (bpp == 4) return v;
+		__m128i a = _mm_unpacklo_epi32(v, _mm_srli_si128(v, 3));
+		__m128i b = _mm_unpacklo_epi32(_mm_srli_si128(v, 6), _mm_srli_si128(v, 9));
+		return _mm_unpacklo_epi64(a, b);
+	}
+
+	// convert a row of w pixels of bpp bytes with 8 bit channels. ri, gi and bi are the byte of each channel in a
+	// pixel. end is the end of the readable data, which the vector loads must not go past
+	static void convert_row8(const uint8_t* src, const uint8_t* end, uint32 w, uint32 bpp, int ri, int gi, int bi, vec3* out) {
+		const float4 s(1.f / 255.f);
+		const __m128i m = _mm_set1_epi32(0xff);
+		uint32 x = 0;
+		for (; x + 4 <= w && src + x*bpp + 16 <= end; x += 4) {
+			__m128i v = gather_pixels4(src + x*bpp, bpp);
+			float4 r = float4(_mm_cvtepi32_ps(_mm_and_si128(_mm_srl_epi32(v, _mm_cvtsi32_si128(ri * 8)), m)))*s;
+			float4 g = float4(_mm_cvtepi32_ps(_mm_and_si128(_mm_srl_epi32(v, _mm_cvtsi32_si128(gi * 8)), m)))*s;
+			float4 b = float4(_mm_cvtepi32_ps(_mm_and_si128(_mm_srl_epi32(v, _mm_cvtsi32_si128(bi * 8)), m)))*s;
+			store_rgb4(out + x, r, g, b);
+		}
+		for (; x < w; ++x) {
+			const uint8_t* p = src + x*bpp;
+			out[x] = vec3((float)p[ri], (float)p[gi], (float)p[bi]) / 255.f;
+		}
+	}
+
+	static texture2d load_bmp(const mapped_file& f) {
+		const uint8_t* d = f.data();
+		if (f.size() < 54) throw runtime_error("invalid BMP header");
+		uint32 offset = read_u32(d + 0x0a), bpp = read_u16(d + 0x1c), compression = read_u32(d + 0x1e);
+		int width = (int)read_u32(d + 0x12), height = (int)read_u32(d + 0x16);
+		if (bpp != 24 && bpp != 32) throw runtime_error("only 24 and 32 bit BMP files are supported");
+		// 32 bit files can have bit fields, but only the usual BGRA order is supported
+		bool bgra_fields = compression == 3 && bpp == 32 && f.size() >= 0x42 &&
+			read_u32(d + 0x36) == 0xff0000 && read_u32(d + 0x3a) == 0xff00 && read_u32(d + 0x3e) == 0xff;
+		if (compression != 0 && !bgra_fields) throw runtime_error("compressed BMP files are not supported");
+		// positive heights are stored bottom row first
+		bool bottom_up = height > 0;
+		uvec2 size = uvec2((uint32)width, (uint32)(bottom_up ? height : -height));
+		if (width <= 0 || size.y == 0) throw runtime_error("invalid BMP size");
+		size_t stride = ((size_t)size.x*(bpp / 8) + 3) & ~(size_t)3;
+		if (offset > f.size() || (f.size() - offset) / stride < size.y) throw runtime_error("BMP file is truncated");
+
+		texture2d tx(size);
+		const uint8_t* end = d + f.size();
+		for_rows(size.y, [&](uint32 y) {
+			const uint8_t* row = d + offset + stride*(bottom_up ? size.y - 1 - y : y);
+			convert_row8(row, end, size.x, bpp / 8, 2, 1, 0, &tx.pixel(uvec2(0, y)));
+		});
+		return tx;
+	}
+
+	// reads the whitespace separated header fields of PPM and PFM files
+	struct pnm_header {
+		const uint8_t* p, *end;
+		pnm_header(const uint8_t* p, const uint8_t* end) : p(p), end(end) {}
+
+		string token() {
+			while (p < end) {
+				if (*p == '#') while (p < end && *p != '\n') ++p;
+				else if (isspace(*p)) ++p;
+				else break;
+			}
+			string t;
+			while (p < end && !isspace(*p)) t += (char)*p++;
+			if (t.empty()) throw runtime_error("image header is truncated");
+			return t;
+		}
+
+		uint32 number() {
+			string t = token();
+			char* e;
+			unsigned long v = strtoul(t.c_str(), &e, 10);
+			if (*e != 0 || v == 0) throw runtime_error("invalid number in image header: " + t);
+			return (uint32)v;
+		}
+
+		// the header ends with a single whitespace character
+		const uint8_t* data() {
+			if (p >= end || !isspace(*p)) throw runtime_error("image header is truncated");
+			return p + 1;
+		}
+	};
+
+	static texture2d load_ppm(const mapped_file& f) {
+		pnm_header h(f.data() + 2, f.data() + f.size());
+		uvec2 size;
+		size.x = h.number();
+		size.y = h.number();
+		uint32 maxval = h.number();
+		if (maxval > 65535) throw runtime_error("invalid PPM maximum value");
+		const uint8_t* d = h.data(), *end = f.data() + f.size();
+		uint32 bpc = maxval < 256 ? 1 : 2;
+		size_t stride = (size_t)size.x * 3 * bpc;
+		if ((size_t)(end - d) / stride < size.y) throw runtime_error("PPM file is truncated");
+
+		texture2d tx(size);
+		float s = 1.f / (float)maxval;
+		for_rows(size.y, [&](uint32 y) {
+			const uint8_t* row = d + stride*y;
+			vec3* out = &tx.pixel(uvec2(0, y));
+			if (bpc == 1) {
+				convert_row8(row, end, size.x, 3, 0, 1, 2, out);
+				if (maxval != 255) for (uint32 x = 0; x < size.x; ++x) out[x] *= 255.f*s;
+			}
+			else {
+				// 16 bit channels are big endian
+				for (uint32 x = 0; x < size.x; ++x, row += 6)
+					out[x] = vec3((float)((row[0] << 8) | row[1]), (float)((row[2] << 8) | row[3]), (float)((row[4] << 8) | row[5]))*s;
+			}
+		});
+		return tx;
+	}
+
+	static texture2d load_pfm(const mapped_file& f) {
+		bool color = f.data()[1] == 'F';
+		pnm_header h(f.data() + 2, f.data() + f.size());
+		uvec2 size;
+		size.x = h.number();
+		size.y = h.number();
+		// the sign of the scale gives the byte order, negative is little endian
+		float scale = (float)atof(h.token().c_str());
+		if (scale == 0.f) throw runtime_error("invalid PFM scale");
+		bool swap_bytes = scale > 0.f;
+		const uint8_t* d = h.data(), *end = f.data() + f.size();
+		uint32 channels = color ? 3 : 1;
+		size_t stride = (size_t)size.x * channels * 4;
+		if ((size_t)(end - d) / stride < size.y) throw runtime_error("PFM file is truncated");
+
+		texture2d tx(size);
+		for_rows(size.y, [&](uint32 y) {
+			// rows are stored bottom row first
+			const uint8_t* row = d + stride*(size.y - 1 - y);
+			vec3* out = &tx.pixel(uvec2(0, y));
+			if (color && !swap_bytes) {
+				memcpy(out, row, stride);
+				return;
+			}
+			for (uint32 x = 0; x < size.x; ++x) {
+				float c[3];
+				for (uint32 i = 0; i < channels; ++i, row += 4) {
+					uint32 v = swap_bytes ? ((uint32)row[0] << 24) | (row[1] << 16) | (row[2] << 8) | row[3] : read_u32(row);
+					memcpy(&c[i], &v, 4);
+				}
+				out[x] = color ? vec3(c[0], c[1], c[2]) : vec3(c[0]);
+			}
+		});
+		return tx;
+	}
+
+	// read one scanline of w RGBE pixels at p into out, or just skip it if out is null
+	// returns where the next scanline starts
+	static const uint8_t* read_rgbe_scanline(const uint8_t* p, const uint8_t* end, uint32 w, uint8_t* out) {
+		bool rle = w >= 8 && w < 32768 && end - p >= 4 && p[0] == 2 && p[1] == 2 && (uint32)((p[2] << 8) | p[3]) == w;
+		if (!rle) {
+			// flat pixels
+			if ((size_t)(end - p) < (size_t)w * 4) throw runtime_error("HDR file is truncated");
+			if (out != nullptr) memcpy(out, p, (size_t)w * 4);
+			return p + (size_t)w * 4;
+		}
+		p += 4;
+		// each channel is run length encoded separately
+		for (uint32 c = 0; c < 4; ++c) {
+			for (uint32 x = 0; x < w;) {
+				if (p >= end) throw runtime_error("HDR file is truncated");
+				uint32 n = *p++;
+				bool run = n > 128;
+				if (run) n -= 128;
+				if (n == 0 || x + n > w || end - p < (run ? 1 : (ptrdiff_t)n)) throw runtime_error("invalid HDR scanline");
+				if (out != nullptr)
+					for (uint32 i = 0; i < n; ++i) out[(x + i) * 4 + c] = run ? p[0] : p[i];
+				p += run ? 1 : n;
+				x += n;
+			}
+		}
+		return p;
+	}
+
+	static inline vec3 rgbe_to_float(const uint8_t* p) {
+		if (p[3] == 0) return vec3(0.f);
+		return (vec3((float)p[0], (float)p[1], (float)p[2]) + .5f)*ldexp(1.f, (int)p[3] - 136);
+	}
+
+	static void convert_rgbe_row(const uint8_t* src, uint32 w, vec3* out) {
+		const __m128i m = _mm_set1_epi32(0xff), nine = _mm_set1_epi32(9);
+		uint32 x = 0;
+		for (; x + 4 <= w; x += 4) {
+			__m128i v = _mm_loadu_si128((const __m128i*)(src + x * 4));
+			__m128i e = _mm_srli_epi32(v, 24);
+			// 2^(e - 136) made straight from the exponent bits, exponents too small for a normal float give 0
+			float4 scale = float4(_mm_castsi128_ps(_mm_slli_epi32(_mm_sub_epi32(e, nine), 23)))
+				& float4(_mm_castsi128_ps(_mm_cmpgt_epi32(e, nine)));
+			float4 r = (float4(_mm_cvtepi32_ps(_mm_and_si128(v, m))) + float4(.5f))*scale;
+			float4 g = (float4(_mm_cvtepi32_ps(_mm_and_si128(_mm_srli_epi32(v, 8), m))) + float4(.5f))*scale;
+			float4 b = (float4(_mm_cvtepi32_ps(_mm_and_si128(_mm_srli_epi32(v, 16), m))) + float4(.5f))*scale;
+			store_rgb4(out + x, r, g, b);
+		}
+		for (; x < w; ++x) out[x] = rgbe_to_float(src + x * 4);
+	}
+
+	static texture2d load_hdr(const mapped_file& f) {
+		const uint8_t* p = f.data(), *end = p + f.size();
+		auto line = [&]() {
+			string l;
+			while (p < end && *p != '\n') l += (char)*p++;
+			if (p >= end) throw runtime_error("HDR header is truncated");
+			++p;
+			return l;
+		};
+		line();
+		// header lines up to an empty one, only the pixel format matters
+		for (string l = line(); !l.empty(); l = line()) {
+			if (l.compare(0, 7, "FORMAT=") == 0 && l != "FORMAT=32-bit_rle_rgbe")
+				throw runtime_error("unsupported HDR pixel format " + l.substr(7));
+		}
+		string res = line(), ys, xs;
+		uint32 h = 0, w = 0;
+		istringstream rs(res);
+		rs >> ys >> h >> xs >> w;
+		if (!rs || xs != "+X" || (ys != "-Y" && ys != "+Y") || w == 0 || h == 0)
+			throw runtime_error("unsupported HDR orientation " + res);
+		// +Y stores the bottom row first
+		bool bottom_up = ys == "+Y";
+		uvec2 size = uvec2(w, h);
+
+		// scanlines have different lengths, so find where each one starts before decoding them in parallel
+		vector<const uint8_t*> rows(size.y);
+		for (uint32 y = 0; y < size.y; ++y) {
+			rows[y] = p;
+			p = read_rgbe_scanline(p, end, size.x, nullptr);
+		}
+
+		texture2d tx(size);
+		for_rows(size.y, [&](uint32 y) {
+			static thread_local vector<uint8_t> rgbe;
+			rgbe.resize((size_t)size.x * 4);
+			read_rgbe_scanline(rows[bottom_up ? size.y - 1 - y : y], end, size.x, rgbe.data());
+			convert_rgbe_row(rgbe.data(), size.x, &tx.pixel(uvec2(0, y)));
+		});
+		return tx;
+	}
+
+	texture2d load_image(const string& filename, texture_layout l) {
+		mapped_file f(filename);
+		const uint8_t* d = f.data();
+		auto starts_with = [&](const char* m) { return f.size() >= strlen(m) && memcmp(d, m, strlen(m)) == 0; };
+		texture2d tx =
+			starts_with("BM") ? load_bmp(f) :
+			starts_with("P6") ? load_ppm(f) :
+			starts_with("PF") || starts_with("Pf") ? load_pfm(f) :
+			starts_with("#?RADIANCE") || starts_with("#?RGBE") ? load_hdr(f) :
+			throw runtime_error("unknown image format in " + filename);
+		tx.set_layout(l);
+		return tx;
+	}
+}
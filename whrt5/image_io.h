@@ -0,0 +1,19 @@
+#pragma once
+#include "cmmn.h"
+#include "texture.h"
+
+namespace whrt5 {
+	/*
+		loads an image file into a texture stored in layout l
+		the file is memory mapped and its rows are converted to floats on the global thread pool. the format is
+		worked out from the contents:
+			BMP		uncompressed, 24 or 32 bits per pixel
+			PPM		binary (P6), 8 or 16 bits per channel
+			PFM		color (PF) or greyscale (Pf), either byte order
+			HDR		Radiance RGBE, flat or run length encoded
+		8 and 16 bit channels map to [0, 1] without any gamma conversion, the same way texture2d::write_bmp writes them
+		row 0 of the texture is the top of the image
+		throws runtime_error if the file can't be read or isn't a valid image
+	*/
+	texture2d load_image(const string& filename, texture_layout l = texture_layout::linear);
+}
@@ -0,0 +1,141 @@
+#pragma once
+#include "cmmn.h"
+
+namespace whrt5 {
+	// how a key moves to the one after it
+	enum class interpolation {
+		// a straight line
+		linear,
+		// starts slow and speeds up, k sets how sharply
+		exp,
+		// starts fast and slows down, the mirror of exp
+		log,
+		// a smooth curve whose tangents come from the neighbouring keys
+		catmull_rom,
+		// a smooth curve that leaves this key and arrives at the next one with their tangents
+		hermite,
+	};
+
+	// the eased blend at x in [0, 1] for exp and log, both go from 0 to 1 and turn into linear as k goes to 0
+	inline float ease(interpolation i, float k, float x) {
+		if (abs(k) < 1e-4f) return x;
+		switch (i) {
+		case interpolation::exp: return expm1(k*x) / expm1(k);
+		case interpolation::log: return log1p(expm1(k)*x) / k;
+		default: return x;
+		}
+	}
+
+	// values sampled at evenly spaced times, lookups are O(1) and interpolate linearly between the samples
+	template<typename T>
+	struct keyframe_table {
+		float t0, rate;
+		vector<T> values;
+
+		T operator()(float t) const {
+			float x = (t - t0)*rate;
+			if (!(x > 0.f)) return values.front();
+			if (x >= (float)(values.size() - 1)) return values.back();
+			size_t i = (size_t)x;
+			return mix(values[i], values[i + 1], x - (float)i);
+		}
+	};
+
+	/*
+		values at times, with each key choosing how it moves to the next one
+		before the first key and after the last the value holds. lookups binary search for the pair of keys around
+		the time, and each thread remembers the last pair it found so that the usual case of times moving forward a
+		little at a time doesn't search at all
+	*/
+	template<typename T>
+	struct keyframes {
+		struct key {
+			float t;
+			T value;
+			interpolation interp;
+			float k;
+			// rate of change per second at this key, for hermite
+			T tangent;
+			key(float t, T v, interpolation i = interpolation::linear, float k = 1.f)
+				: t(t), value(v), interp(i), k(k), tangent(v*0.f) {}
+			key(float t, T v, T tangent)
+				: t(t), value(v), interp(interpolation::hermite), k(1.f), tangent(tangent) {}
+		};
+		vector<key> keys;
+
+		keyframes(const vector<key>& keys) : keys(keys) { sort_keys(); }
+		keyframes(initializer_list<key> keys) : keys(keys.begin(), keys.end()) { sort_keys(); }
+
+		T operator()(float t) const {
+			if (!(t > keys.front().t)) return keys.front().value;
+			if (t >= keys.back().t) return keys.back().value;
+			size_t i = segment(t);
+			return interpolate(i, (t - keys[i].t) / (keys[i + 1].t - keys[i].t));
+		}
+
+		// sample rate times per second between the first and last key, the last sample lands on the last key
+		// keys that fall between samples are smoothed over, so rate should be well above how often keys change
+		keyframe_table<T> bake(float rate) const {
+			keyframe_table<T> tb;
+			tb.t0 = keys.front().t;
+			float span = keys.back().t - tb.t0;
+			size_t count = (size_t)ceil(span*rate) + 1;
+			tb.rate = count > 1 ? (float)(count - 1) / span : 0.f;
+			tb.values.reserve(count);
+			for (size_t i = 0; i < count; ++i)
+				tb.values.push_back((*this)(i + 1 == count ? keys.back().t : tb.t0 + (float)i / tb.rate));
+			return tb;
+		}
+
+	private:
+		static const size_t cursor_slots = 8;
+
+		void sort_keys() {
+			if (keys.empty()) throw runtime_error("keyframes need at least one key");
+			stable_sort(keys.begin(), keys.end(), [](const key& a, const key& b) { return a.t < b.t; });
+		}
+
+		// the i where keys[i].t <= t < keys[i + 1].t, t must be in [front, back)
+		size_t segment(float t) const {
+			// a few slots per thread so that several keyframes looked up in turn don't keep throwing out each
+			// other's cursor. a slot can be left over from keyframes that no longer exist, so it is only a guess
+			// that gets checked
+			struct cursor { const keyframes* owner; size_t i; };
+			static thread_local cursor cursors[cursor_slots];
+			cursor& c = cursors[((uintptr_t)this / sizeof(keyframes)) % cursor_slots];
+			if (c.owner == this) {
+				size_t end = glm::min(c.i + 2, keys.size() - 1);
+				for (size_t i = c.i; i < end; ++i)
+					if (keys[i].t <= t && t < keys[i + 1].t) return c.i = i;
+			}
+			size_t i = upper_bound(keys.begin(), keys.end(), t, [](float t, const key& k) { return t < k.t; }) - keys.begin() - 1;
+			c.owner = this; c.i = i;
+			return i;
+		}
+
+		// the catmull-rom tangent at key i, from the keys on either side of it
+		T slope(size_t i) const {
+			size_t p = i > 0 ? i - 1 : i, n = i + 1 < keys.size() ? i + 1 : i;
+			float dt = keys[n].t - keys[p].t;
+			return dt > 0.f ? (keys[n].value - keys[p].value) / dt : keys[i].value*0.f;
+		}
+
+		// the value x of the way from keys[i] to keys[i + 1]
+		T interpolate(size_t i, float x) const {
+			const key &a = keys[i], &b = keys[i + 1];
+			switch (a.interp) {
+			case interpolation::catmull_rom:
+			case interpolation::hermite: {
+				bool h = a.interp == interpolation::hermite;
+				T m0 = h ? a.tangent : slope(i), m1 = h ? b.tangent : slope(i + 1);
+				// cubic hermite basis, the tangents are per second so they are scaled to the length of the segment
+				float dt = b.t - a.t, x2 = x*x, x3 = x2*x;
+				return a.value*(2.f*x3 - 3.f*x2 + 1.f) + b.value*(3.f*x2 - 2.f*x3) +
+					m0*((x3 - 2.f*x2 + x)*dt) + m1*((x3 - x2)*dt);
+			}
+			default:
+				return mix(a.value, b.value, ease(a.interp, a.k, x));
+			}
+		}
+	};
+}
@@ -1,160 +1,360 @@
 
 #include "cmmn.h"
 #include "texture.h"
+#include "noise_texture.h"
 #include "camera.h"
-#include "video.h"
 #include "surface.h"
+#include "primitive.h"
+#include "compiled_scene.h"
 #include "motion.h"
+#include "keyframes.h"
+#include "sampler.h"
+#include "pipeline.h"
+#include "frame_sink.h"
+#include <atomic>
+#include <iomanip>
 
 namespace whrt5 {
 
-	enum class interpolation {
-		linear, exp, log
+	/*
+		settings for adaptive sampling, where each pixel keeps taking samples only until it looks converged
+		a pixel takes at least min_samples and at most max_samples samples, and stops in between once the standard
+		error of its mean luminance is below threshold times the mean (or times 0.1 for dark pixels, so that they
+		don't need a vanishingly small error)
+	*/
+	struct adaptive_sampling {
+		bool enabled;
+		uint32 min_samples, max_samples;
+		float threshold;
+
+		adaptive_sampling() : enabled(false), min_samples(0), max_samples(0), threshold(0.f) {}
+		adaptive_sampling(uint32 min_samples, uint32 max_samples, float threshold)
+			: enabled(true), min_samples(glm::max(2u, min_samples)), max_samples(glm::max(glm::max(2u, min_samples), max_samples)),
+			  threshold(threshold) {}
+
+		// n samples with running luminance mean and sum of squared differences m2 (from Welford's algorithm)
+		inline bool converged(uint32 n, float mean, float m2) const {
+			if (n < min_samples) return false;
+			float std_error = sqrt(m2 / (float)((n - 1)*n));
+			return std_error <= threshold * glm::max(mean, 0.1f);
+		}
 	};
-	template<typename T>
-	struct keyframes {
-		struct key {
+
+	struct renderer {
+		shared_ptr<primitive> scene;
+		camera cam;
+		// samples per pixel, when not sampling adaptively
+		const uint32 spp;
+		shared_ptr<sampler> smp;
+		// trace the samples of each pixel in packets of packet_width rays
+		bool packets;
+		adaptive_sampling adaptive;
+		// if nonzero, render progressively: passes of pass_samples samples per pixel are added up in an HDR buffer
+		// until another pass wouldn't fit in this much time, which replaces spp and adaptive sampling
+		chrono::milliseconds time_budget;
+		uint32 pass_samples;
+		/*
+			cache of primary hits for animations where the camera doesn't move
+			every pixel sample then uses the same camera ray in every frame, and the hit of that ray and whether the
+			hit is in shadow are kept for each sample. a sample is only traced again where its camera ray (up to the
+			hit) or its shadow ray passes through the bounds of something that moves in the frame, and reflections
+			are always traced
+			the cache holds the spp samples of each pixel, or the first min_samples when sampling adaptively, and
+			isn't used in progressive mode
+		*/
+		bool cache_primary_hits;
+		// if set, called with the tiles done and the tile count of each raster pass while it runs, on the thread
+		// that called render
+		function<void(uint32, uint32)> progress;
+		renderer(shared_ptr<primitive> scene, camera cam, uint32 spp,
+			shared_ptr<sampler> smp = make_shared<samplers::sobol>(), bool packets = true)
+			: scene(scene), cam(cam), spp(spp), smp(smp), packets(packets), time_budget(0), pass_samples(packet_width),
+			  cache_primary_hits(false), gbuffer_samples(0), gbuffer_size(0) {}
+
+		struct cached_sample {
+			// distance to the hit, FLT_MAX if the camera ray missed
 			float t;
-			T value;
-			interpolation interp;
-			float k;
-			key(float t, T v, interpolation i = interpolation::linear, float k = 1.f)
-				: t(t), value(v), interp(i), k(k) {}
+			vec3 norm;
+			vec2 texc, dx, dy;
+			const material* mat;
+			// the hit can be reused, and the shadow can be reused
+			bool valid, shadow_valid;
+			bool shadowed;
+			cached_sample() : valid(false), shadow_valid(false) {}
 		};
-		vector<key> keys;
+		vector<cached_sample> gbuffer;
+		// samples per pixel in gbuffer and the size and camera it was made for
+		uint32 gbuffer_samples;
+		uvec2 gbuffer_size;
+		camera gbuffer_cam;
+		// bounds of everything that moves in the frame being rendered
+		vector<aabb> moving;
 
-		keyframes(const vector<key> keys) : keys(keys) {}
-		keyframes(initializer_list<key> keys) : keys(keys.begin(), keys.end()) {}
+		vec3 background(const ray&) {
+			return vec3(0.05f, 0.05f, 0.5f);
+		}
 
-		T operator()(float t) const {
-			for (size_t i = 0; i < keys.size()-1; ++i) {
-				float tt = keys[i].t, nt = keys[i + 1].t;
-				if (tt < t && t < nt) {
-					auto M = (t-tt)/(nt-tt);
-					switch (keys[i].interp) {
-					case interpolation::exp: M = exp(keys[i].k * M); break;
-					case interpolation::log: M = log(keys[i].k * M); break;
-					}
-					return mix(keys[i].value, keys[i + 1].value, M);
-				}
+		// color of a hit at distance t along r, shadowed says if the light is blocked and rc is the recursion depth
+		// dx and dy are the texture footprint from footprint(), or zero to take a single texel
+		vec3 shade(const ray& r, float t, vec3 norm, vec2 texc, vec2 dx, vec2 dy, const material* m, bool shadowed, uint32_t rc) {
+			const vec3 L = vec3(0.f, 1.f, 0.f);
+			vec3 col = m->tex->texel(texc, dx, dy)*(glm::max(0.f, dot(norm, L))*(shadowed ? 0.f : 1.f));
+			if (m->reflect > 0.f) {
+				col += m->reflect * ray_color(ray(r(t) + norm*0.01f, reflect(r.d, norm), r.time), rc + 1);
 			}
-			return keys[keys.size() - 1].value;
+			return col;
 		}
-	};
 
-	struct material {
-		shared_ptr<texture<vec3, vec2>> tex;
-		float reflect;
+		// how far the texture coordinates move from a hit at p with normal n and texture gradients dudp and dvdp
+		// to where the differential ray r crosses the hit's tangent plane
+		static inline vec2 texc_offset(const ray& r, vec3 p, vec3 n, vec3 dudp, vec3 dvdp) {
+			float D = dot(n, r.d);
+			if (abs(D) < 1e-6f) return vec2(0.f);
+			vec3 d = r(dot(p - r.e, n) / D) - p;
+			return vec2(dot(dudp, d), dot(dvdp, d));
+		}
 
-		material(shared_ptr<texture<vec3, vec2>> t, float ref = 0.f) : tex(t), reflect(ref) {}
-	};
-	struct hit_record : public surfaces::hit_record {
-		shared_ptr<material> mat;
-	};
-	struct primitive {
-		virtual bool hit(const ray& r, hit_record* hr) const = 0;
-	};
-	struct surface_primitive : public primitive {
-		shared_ptr<material> mat;
-		shared_ptr<surfaces::surface> surf;
+		// the footprint of the hit of camera ray r on material m in texture space, nothing for textures that
+		// don't filter or surfaces that don't give their texture gradients
+		static inline void footprint(const ray_differentials& diff, const ray& r, float t, vec3 n, vec3 dudp, vec3 dvdp,
+			const material* m, vec2& dx, vec2& dy) {
+			dx = dy = vec2(0.f);
+			if (!m->tex->filtered()) return;
+			vec3 p = r(t);
+			dx = texc_offset(diff.rx, p, n, dudp, dvdp);
+			dy = texc_offset(diff.ry, p, n, dudp, dvdp);
+		}
 
-		surface_primitive(shared_ptr<surfaces::surface> surf, shared_ptr<material> m)
-			: surf(surf), mat(m) {
+		// diff is only given for camera rays, other rays take single texels
+		vec3 ray_color(const ray& r, uint32_t rc = 0, const ray_differentials* diff = nullptr) {
+			if (rc > 6) return background(r);
+			const vec3 L = vec3(0.f, 1.f, 0.f);
+			hit_record hr;
+			if (scene->hit(r, &hr)) {
+				if (hr.mat == nullptr) return background(r);
+				auto sr = ray(r(hr.t) + hr.norm*0.01f, L, r.time);
+				vec2 dx = vec2(0.f), dy = vec2(0.f);
+				if (diff != nullptr) footprint(*diff, r, hr.t, hr.norm, hr.dudp, hr.dvdp, hr.mat.get(), dx, dy);
+				return shade(r, hr.t, hr.norm, hr.texc, dx, dy, hr.mat.get(), scene->occluded(sr, FLT_MAX), rc);
+			}
+			else
+				return background(r);
 		}
 
-		bool hit(const ray& r, hit_record* hr) const {
-			if (surf->hit(r, hr)) {
-				hr->mat = mat;
-				return true;
+		// true if r passes through the bounds of something that moves in this frame before tmax
+		bool touches_moving(const ray& r, float tmax) const {
+			for (const auto& b : moving) {
+				auto iv = b.hit_retint(r);
+				if (iv.second >= glm::max(iv.first, 0.f) && iv.first <= tmax) return true;
 			}
 			return false;
 		}
-	};
-
-	struct transform_primitive : public primitive {
-		shared_ptr<primitive> p;
-		animated<mat4> transform;
-
-		transform_primitive(shared_ptr<primitive> p, animated<mat4> t) : p(p), transform(t) {}
 
-		bool hit(const ray& r, hit_record* hr) const {
-			auto t = inverse(transform(r.time));
-			auto R = ray(t*vec4(r.e, 1.f), t*vec4(r.d, 0.f), r.time);
-			return p->hit(R, hr);
+		// ray_color for the camera ray r of a cached sample, tracing only what the moving objects could have changed
+		// and updating the cache with it
+		vec3 ray_color_cached(const ray& r, const ray_differentials& diff, cached_sample& c) {
+			const vec3 L = vec3(0.f, 1.f, 0.f);
+			if (!c.valid || touches_moving(r, c.t)) {
+				hit_record hr;
+				bool hit = scene->hit(r, &hr);
+				c.t = hit ? hr.t : FLT_MAX;
+				c.norm = hr.norm;
+				c.texc = hr.texc;
+				c.mat = hit ? hr.mat.get() : nullptr;
+				if (c.mat != nullptr) footprint(diff, r, c.t, hr.norm, hr.dudp, hr.dvdp, c.mat, c.dx, c.dy);
+				// if the ray misses everything that moves up to its hit, the hit is static and will stay the first one
+				c.valid = !touches_moving(r, c.t);
+				c.shadow_valid = false;
+			}
+			if (c.mat == nullptr) return background(r);
+			auto sr = ray(r(c.t) + c.norm*0.01f, L, r.time);
+			if (!c.shadow_valid || touches_moving(sr, FLT_MAX)) {
+				c.shadowed = scene->occluded(sr, FLT_MAX);
+				c.shadow_valid = !touches_moving(sr, FLT_MAX);
+			}
+			return shade(r, c.t, c.norm, c.texc, c.dx, c.dy, c.mat, c.shadowed, 0);
 		}
-	};
 
-	struct pgroup : public primitive {
-		vector<shared_ptr<primitive>> objs;
-		pgroup(vector<shared_ptr<primitive>> s) : objs(s) {}
-		pgroup(initializer_list<shared_ptr<primitive>> s) : objs(s.begin(), s.end()) {}
-
-		bool hit(const ray& r, hit_record* hr) const override {
-			hit_record low; bool hit = false;
-			for (const auto s : objs) {
-				hit_record thr;
-				if (s->hit(r, &thr)) {
-					if (thr.t < low.t) low = thr;
-					hit = true;
+		// packet version of ray_color, writes the color of each lane in mask to col
+		// the closest hits and the shadow rays are traced as packets, lanes with reflective materials
+		// continue on their own through ray_color
+		// diff has the differentials of each lane of a packet of camera rays
+		void ray_color4(const ray4& r, int mask, vec3* col, const ray_differentials* diff = nullptr) {
+			const vec3 L = vec3(0.f, 1.f, 0.f);
+			hit_record4 hr;
+			int hits = scene->hit4(r, mask, hr);
+			int lit = 0;
+			for (int i = 0; i < packet_width; ++i)
+				if ((hits & (1 << i)) && hr.mat[i] != nullptr) lit |= 1 << i;
+			vec3x4 p = r(hr.t) + hr.norm*float4(0.01f);
+			ray4 sr(p, vec3x4(L), r.time);
+			int shadowed = lit == 0 ? 0 : scene->occluded4(sr, lit, float4(FLT_MAX));
+			float4 ndl = vmax(dot(hr.norm, vec3x4(L)), float4(0.f)) & lane_mask(lit & ~shadowed);
+			vec2 dx[packet_width], dy[packet_width];
+			for (int i = 0; i < packet_width; ++i) dx[i] = dy[i] = vec2(0.f);
+			int filtered = 0;
+			if (diff != nullptr) {
+				for (int i = 0; i < packet_width; ++i) {
+					if (!(lit & (1 << i)) || !hr.mat[i]->tex->filtered()) continue;
+					footprint(diff[i], r[i], hr.t[i], hr.norm[i], hr.dudp[i], hr.dvdp[i], hr.mat[i], dx[i], dy[i]);
+					filtered |= 1 << i;
+				}
+			}
+			// lanes without a footprint are looked up a texture at a time with texel_batch
+			vec3 tc[packet_width];
+			for (int pending = lit & ~filtered; pending != 0;) {
+				const texture<vec3, vec2>* tex = nullptr;
+				vec2 uv[packet_width]; int lanes[packet_width]; int n = 0;
+				for (int i = 0; i < packet_width; ++i) {
+					if (!(pending & (1 << i))) continue;
+					if (tex == nullptr) tex = hr.mat[i]->tex.get();
+					if (hr.mat[i]->tex.get() != tex) continue;
+					uv[n] = hr.texc[i];
+					lanes[n++] = i;
+					pending &= ~(1 << i);
+				}
+				vec3 out[packet_width];
+				tex->texel_batch(uv, out, n);
+				for (int k = 0; k < n; ++k) tc[lanes[k]] = out[k];
+			}
+			for (int i = 0; i < packet_width; ++i) {
+				if (!(mask & (1 << i))) continue;
+				if (!(lit & (1 << i))) {
+					col[i] = background(r[i]);
+					continue;
+				}
+				const material* m = hr.mat[i];
+				if (filtered & (1 << i)) tc[i] = m->tex->texel(hr.texc[i], dx[i], dy[i]);
+				col[i] = tc[i]*ndl[i];
+				if (m->reflect > 0.f) {
+					vec3 n = hr.norm[i];
+					col[i] += m->reflect * ray_color(ray(p[i], reflect(r.d[i], n), r.time[i]), 1);
 				}
 			}
-			if (hr != nullptr && low.t < hr->t) *hr = low;
-			return hit;
 		}
-	};
-
-	struct renderer {
-		shared_ptr<primitive> scene;
-		camera cam;
-		const uint8 smp;
-		renderer(shared_ptr<primitive> scene, camera cam, uint8 smp)
-			: scene(scene), cam(cam), smp(smp) {}
 
-		vec3 background(const ray&) {
-			return vec3(0.05f, 0.05f, 0.5f);
+		// camera ray for sample id in a frame of size fsz at time t
+		// the differentials are a pixel apart, scaled down as the pixel takes more samples since those filter as well
+		inline ray sample_ray(const sample_id& id, vec2 fsz, float t, ray_differentials* diff = nullptr) const {
+			sample_cursor c(*smp, id);
+			vec2 uv = (((vec2)(id.px)+c.get2d()) / fsz)*2.f - 1.f;
+			vec2 duv = (2.f / fsz) * glm::max(.125f, 1.f / sqrt((float)id.count));
+			return cam.generate_ray(uv, t, c, duv, diff);
 		}
 
-		vec3 ray_color(const ray& r, uint32_t rc = 0) {
-			if (rc > 6) return background(r);
-			const vec3 L = vec3(0.f, 1.f, 0.f);
-			hit_record hr;
-			if (scene->hit(r, &hr)) {
-				if (hr.mat == nullptr) return background(r);
-				vec3 p = r(hr.t);
-				hit_record shr;
-				float shadow = 1.f;
-				auto sr = ray(p + hr.norm*0.01f, L, r.time);
-				if (scene->hit(sr, &shr)) {
-					shadow = .0f;
+		// trace samples [first, first+count) out of total for pixel px, and pass the color of each to add
+		template<typename F>
+		void trace_samples(uint32 frame, uvec2 px, uint32 first, uint32 count, uint32 total, vec2 fsz, float t, F add) {
+			uint32 end = first + count;
+			if (gbuffer_samples > 0) {
+				cached_sample* cs = &gbuffer[(px.x + px.y*gbuffer_size.x)*gbuffer_samples];
+				for (; first < end && first < gbuffer_samples; ++first) {
+					ray_differentials diff;
+					ray r = sample_ray(sample_id(frame, px, first, total), fsz, t, &diff);
+					add(ray_color_cached(r, diff, cs[first]));
+				}
+			}
+			if (packets) {
+				for (uint32 s = first; s < end; s += packet_width) {
+					ray rs[packet_width]; int mask = 0;
+					ray_differentials diffs[packet_width];
+					for (uint32 i = 0; i < packet_width; ++i) {
+						if (s + i >= end) { rs[i] = rs[0]; continue; }
+						rs[i] = sample_ray(sample_id(frame, px, s + i, total), fsz, t, &diffs[i]);
+						mask |= 1 << i;
+					}
+					vec3 pc[packet_width];
+					ray_color4(ray4(rs), mask, pc, diffs);
+					for (int i = 0; i < packet_width; ++i)
+						if (mask & (1 << i)) add(pc[i]);
 				}
-				vec3 col = hr.mat->tex->texel(hr.texc)*(glm::max(0.f, dot(hr.norm, L))*shadow);
-				if (hr.mat->reflect > 0.f) {
-					col += hr.mat->reflect * ray_color(ray(p + hr.norm*0.01f, reflect(r.d, hr.norm), r.time), rc + 1);
+			}
+			else {
+				for (uint32 s = first; s < end; ++s) {
+					ray_differentials diff;
+					ray r = sample_ray(sample_id(frame, px, s, total), fsz, t, &diff);
+					add(ray_color(r, 0, &diff));
 				}
-				return col;
 			}
-			else
-				return background(r);
 		}
 
+		// sums of the samples of each pixel in progressive mode
+		vector<vec3> accum;
+
 		void render(texture2d& rt, float t) {
 			auto render_start = chrono::high_resolution_clock::now();
-			rt.tiled_multithreaded_raster(uvec2(32), [&](uvec2 px) {
-				vec3 col = vec3(0.f);
-				for (uint8 sy = 0; sy < smp; ++sy)
-					for (uint8 sx = 0; sx < smp; ++sx) {
-						vec2 ss = (vec2(sx, sy) + rnd::randf2()) / (float)smp;
-						vec2 uv = (((vec2)(px)+ss) / (vec2)rt.size)*2.f - 1.f;
-						auto r = cam.generate_ray(uv, t);
-						col += ray_color(r);
+			scene->prepare(t, t + cam.shutter_length);
+			uint32 frame = rnd::frame_key(t);
+			if (cache_primary_hits && time_budget.count() == 0) {
+				// cached samples need the same camera rays in every frame
+				frame = 0;
+				uint32 n = adaptive.enabled ? adaptive.min_samples : spp;
+				if (n != gbuffer_samples || rt.size != gbuffer_size || !cam.same_rays(gbuffer_cam)) {
+					gbuffer.assign((size_t)rt.size.x*rt.size.y*n, cached_sample());
+					gbuffer_samples = n;
+					gbuffer_size = rt.size;
+					gbuffer_cam = cam;
+				}
+				moving.clear();
+				scene->moving_bounds(t, t + cam.shutter_length, moving);
+			}
+			else {
+				gbuffer.clear();
+				gbuffer_samples = 0;
+			}
+			vec2 fsz = (vec2)rt.size;
+			atomic<uint64_t> traced(0);
+			if (time_budget.count() > 0) {
+				// the sampler needs a sample count up front, so every pass takes the next part of a long sequence
+				const uint32 max_samples = 1u << 16;
+				accum.assign(rt.size.x*rt.size.y, vec3(0.f));
+				uint32 n = 0;
+				auto pass_time = chrono::high_resolution_clock::duration(0);
+				do {
+					auto pass_start = chrono::high_resolution_clock::now();
+					rt.tiled_multithreaded_raster(uvec2(32), [&](uvec2 px) {
+						vec3& a = accum[px.x + px.y*rt.size.x];
+						trace_samples(frame, px, n, pass_samples, max_samples, fsz, t, [&](vec3 c) { a += c; });
+						return pow(a / (float)(n + pass_samples), vec3(1.f / 2.2f));
+					}, progress);
+					n += pass_samples;
+					pass_time = chrono::high_resolution_clock::now() - pass_start;
+				} while (chrono::high_resolution_clock::now() - render_start + pass_time <= time_budget
+					&& n + pass_samples <= max_samples);
+				traced = (uint64_t)n*rt.size.x*rt.size.y;
+			}
+			else {
+				rt.tiled_multithreaded_raster(uvec2(32), [&](uvec2 px) {
+					vec3 col = vec3(0.f);
+					uint32 n = 0;
+					if (adaptive.enabled) {
+						float mean = 0.f, m2 = 0.f;
+						auto add = [&](vec3 c) {
+							col += c; n++;
+							float l = dot(c, vec3(0.2126f, 0.7152f, 0.0722f));
+							float d = l - mean;
+							mean += d / (float)n;
+							m2 += d * (l - mean);
+						};
+						uint32 max_n = adaptive.max_samples, batch = packets ? packet_width : 1;
+						trace_samples(frame, px, 0, adaptive.min_samples, max_n, fsz, t, add);
+						while (n < max_n && !adaptive.converged(n, mean, m2))
+							trace_samples(frame, px, n, glm::min(batch, max_n - n), max_n, fsz, t, add);
+					}
+					else {
+						n = spp;
+						trace_samples(frame, px, 0, spp, spp, fsz, t, [&](vec3 c) { col += c; });
 					}
-				col /= (float)(smp*smp);
-				col = pow(col, vec3(1.f / 2.2f));
-				return col;
-			});
+					traced.fetch_add(n, memory_order_relaxed);
+					col /= (float)n;
+					col = pow(col, vec3(1.f / 2.2f));
+					return col;
+				}, progress);
+			}
 			auto render_time = chrono::high_resolution_clock::now() - render_start;
 			ostringstream watermark;
-			watermark << "render took " << chrono::duration_cast<chrono::milliseconds>(render_time).count() << "ms" << endl;
+			watermark << "render took " << chrono::duration_cast<chrono::milliseconds>(render_time).count() << "ms, "
+				<< fixed << setprecision(1) << (double)traced / (double)(rt.size.x*rt.size.y) << " spp" << endl;
 			rt.draw_text(watermark.str(), uvec2(2, 2), vec3(1.f, 1.f, 0.f));
 		}
 	};
@@ -163,29 +363,36 @@ namespace whrt5 {
 using namespace whrt5;
 #define VIDEO
 int main(int argc, char* argv[]) {
-	//rnd::RNG = mt19937(random_device()());
-
 	{
 		animated<float> a(4.f);
 		animated<float> b([](float t) {return sinf(t); });
-		cout << a(0) << " " << a(1) << " " << b(0) << " " << b(1) << endl;
+		cerr << a(0) << " " << a(1) << " " << b(0) << " " << b(1) << endl;
 		assert(a(0) == 4.f);
 		assert(a(1) == 4.f);
 		assert(b(0) == 0.f);
 	}
 
-	ostringstream fns;
-	fns << "r" << chrono::system_clock::now().time_since_epoch().count()
+	// where the frames go, see make_sink for the options
+	// progress goes to stderr so that frames can be streamed to stdout
+	string output;
+	if (argc > 1)
+		output = argv[1];
+	else {
+		ostringstream fns;
+		fns << "r" << chrono::system_clock::now().time_since_epoch().count()
 #ifdef VIDEO
-		<< ".ogg";
+			<< ".ogg";
 #else
-		<< ".bmp";
+			<< ".bmp";
 #endif
+		output = fns.str();
+	}
 	uint32 fps = 30;
 	auto res = //uvec2(320, 240);
 				uvec2(640, 480);
-	const int fc = fps * 15;
-	const uint8 smp = 8; 
+	const uint32 fc = fps * 15;
+	// Owen-scrambled Sobol samples converge much faster than the old 8x8 jittered grid
+	const uint32 spp = 16;
 #ifdef TEST
 	auto rndr = renderer(make_shared<pgroup>(
 		pgroup {
@@ -233,7 +440,7 @@ int main(int argc, char* argv[]) {
 			make_shared<surface_primitive>(make_shared<surfaces::box>(vec3(0.f), vec3(5.f, 0.1f, 5.f)),
 				make_shared<material>(make_shared<checkerboard_texture>(vec3(1.f, 1.f, 0.f), vec3(0.f, 1.f, 0.f), 2.f)))
 		}),
-		camera(vec3(0.f, 12.f, -12.f), vec3(0.f), 0.01f, 5.f, 1.f / (float)fps), smp
+		camera(vec3(0.f, 12.f, -12.f), vec3(0.f), 0.01f, 5.f, 1.f / (float)fps), spp
 	);
 #else
 	auto scene = make_shared<pgroup>(pgroup{
@@ -242,7 +449,8 @@ int main(int argc, char* argv[]) {
 	});
 
 	auto mallet1 = motion::single_mallet();
-	auto bar_mat = make_shared<material>(make_shared<const_texture<vec3, vec2>>(vec3(0.6f, 0.2f, 0.9f)));
+	// the noise is baked once so that the bars cost a texture lookup per sample
+	auto bar_mat = make_shared<material>(bake_texture(*make_wood(vec3(0.72f, 0.5f, 0.3f), vec3(0.45f, 0.26f, 0.12f)), uvec2(512)));
 	for (int i = 0; i < 5; ++i) {
 		vec3 p = vec3((float)i / 2.f, .5f, 0.f);
 		mallet1.inst_pos[i + 60] = motion::loc_rot(p+vec3(0.f, 0.2f, -.7f), vec3(-.3f + pi<float>()*0.5f, 0.f, 0.f));
@@ -255,24 +463,43 @@ int main(int argc, char* argv[]) {
 	}
 
 	scene->objs.push_back(make_shared<transform_primitive>(make_shared<surface_primitive>(make_shared<surfaces::cylinder>(0.15f, 1.f),
-		make_shared<material>(make_shared<const_texture<vec3, vec2>>(vec3(0.4f)))), mallet1));
+		make_shared<material>(make_brushed_metal(vec3(0.4f), vec3(0.6f)))), mallet1));
 
-	auto rndr = renderer(scene, camera(vec3(3.f, 6.f, -4.f), vec3(0.f), 0.01f, 5.f, 1.f / (float)fps), smp);
+	auto rndr = renderer(compile_scene(scene->objs), camera(vec3(3.f, 6.f, -4.f), vec3(0.f), 0.01f, 5.f, 1.f / (float)fps), spp);
+	// most of the frame is flat background and bars that converge after a few samples
+	rndr.adaptive = adaptive_sampling(4, 64, 0.02f);
 #endif
+	// the camera is fixed in both scenes, so only what the moving objects touch needs to be traced each frame
+	rndr.cache_primary_hits = true;
+	// a second argument renders previews progressively with that many milliseconds per frame
+	if (argc > 2)
+		rndr.time_budget = chrono::milliseconds(atoi(argv[2]));
 
-	auto rt = texture2d(res);
-	
 #ifdef VIDEO
-	video v{ fns.str(), res, {fps,1} };
-	for (uint i = 0; i < fc; ++i) {
+	auto sink = make_sink(output, res, { fps,1 });
+	// frames are rastered in 32x32 tiles, which are contiguous in the morton layout
+	render_pipeline pl(res, 3, texture_layout::morton);
+	uint32 frame = 0;
+	// one status line, redrawn from the pool's counters while each frame renders
+	rndr.progress = [&](uint32 done, uint32 tiles) {
+		cerr << "\rframe " << frame + 1 << " of " << fc << ", " << done << "/" << tiles << " tiles   " << flush;
+	};
+	pl.run(fc, [&](texture2d& rt, uint32 i) {
+		frame = i;
 		rndr.render(rt, (float)i / (float)fps);
-		v.write_frame(rt, i == fc - 1);
-		cout << "frame " << i << " of " << fc << endl;
-	}
-	v.flush();
+	}, [&](const texture2d& rt, uint32 i) {
+		sink->write_frame(rt, i, i == fc - 1);
+	});
+	cerr << endl;
+	sink->flush();
 #else
+	auto rt = texture2d(res, texture_layout::morton);
+	rndr.progress = [](uint32 done, uint32 tiles) {
+		cerr << "\r" << done << "/" << tiles << " tiles   " << flush;
+	};
 	rndr.render(rt, 3.f);
-	rt.write_bmp(fns.str());
+	cerr << endl;
+	rt.write_bmp(output);
 #endif
 
 
@@ -0,0 +1,73 @@
+#include "mapped_file.h"
+
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#define NOMINMAX
+#include <Windows.h>
+#else
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+namespace whrt5 {
+#ifdef _WIN32
+	mapped_file::mapped_file(const string& filename)
+		: _data(nullptr), _size(0), file(INVALID_HANDLE_VALUE), mapping(nullptr)
+	{
+		file = CreateFileA(filename.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING,
+			FILE_ATTRIBUTE_NORMAL | FILE_FLAG_RANDOM_ACCESS, nullptr);
+		if (file == INVALID_HANDLE_VALUE) throw runtime_error(string("couldn't open file ") + filename);
+		LARGE_INTEGER sz;
+		if (!GetFileSizeEx(file, &sz)) {
+			CloseHandle(file);
+			throw runtime_error(string("couldn't stat file ") + filename);
+		}
+		_size = (size_t)sz.QuadPart;
+		if (_size == 0) return;
+		mapping = CreateFileMappingA(file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+		if (mapping == nullptr) {
+			CloseHandle(file);
+			throw runtime_error(string("couldn't map file ") + filename);
+		}
+		_data = (const uint8_t*)MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+		if (_data == nullptr) {
+			CloseHandle(mapping);
+			CloseHandle(file);
+			throw runtime_error(string("couldn't map file ") + filename);
+		}
+	}
+
+	mapped_file::~mapped_file() {
+		if (_data != nullptr) UnmapViewOfFile(_data);
+		if (mapping != nullptr) CloseHandle(mapping);
+		if (file != INVALID_HANDLE_VALUE) CloseHandle(file);
+	}
+#else
+	mapped_file::mapped_file(const string& filename)
+		: _data(nullptr), _size(0), fd(-1)
+	{
+		fd = open(filename.c_str(), O_RDONLY);
+		if (fd < 0) throw runtime_error(string("couldn't open file ") + filename);
+		struct stat st;
+		if (fstat(fd, &st) != 0) {
+			close(fd);
+			throw runtime_error(string("couldn't stat file ") + filename);
+		}
+		_size = (size_t)st.st_size;
+		if (_size == 0) return;
+		void* p = mmap(nullptr, _size, PROT_READ, MAP_PRIVATE, fd, 0);
+		if (p == MAP_FAILED) {
+			close(fd);
+			throw runtime_error(string("couldn't map file ") + filename);
+		}
+		_data = (const uint8_t*)p;
+	}
+
+	mapped_file::~mapped_file() {
+		if (_data != nullptr) munmap((void*)_data, _size);
+		if (fd >= 0) close(fd);
+	}
+#endif
+}
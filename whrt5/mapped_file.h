@@ -0,0 +1,29 @@
+#pragma once
+#include "cmmn.h"
+
+namespace whrt5 {
+	/*
+		a whole file mapped read only into memory
+		pages are read in by the OS as they are touched, so opening even a very large file is nearly free
+	*/
+	class mapped_file {
+		const uint8_t* _data;
+		size_t _size;
+#ifdef _WIN32
+		void* file;
+		void* mapping;
+#else
+		int fd;
+#endif
+	public:
+		// map the file at filename, throws runtime_error if it can't be opened
+		mapped_file(const string& filename);
+		~mapped_file();
+
+		mapped_file(const mapped_file&) = delete;
+		mapped_file& operator =(const mapped_file&) = delete;
+
+		inline const uint8_t* data() const { return _data; }
+		inline size_t size() const { return _size; }
+	};
+}
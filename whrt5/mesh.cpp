@@ -0,0 +1,309 @@
+#include "mesh.h"
+
+namespace whrt5 {
+	namespace surfaces {
+		static_assert(sizeof(vec3) == 12 && sizeof(vec2) == 8 && sizeof(uvec3) == 12, "mesh files store vectors as packed floats");
+		static_assert(sizeof(mesh::node) == 32, "mesh nodes should be 32 bytes");
+
+		struct mesh_file_header {
+			char magic[4];
+			uint32 vertex_count, triangle_count, node_count;
+			uint32 flags;
+			uint32 reserved[3];
+		};
+		const uint32 mesh_has_normals = 1, mesh_has_texcoords = 2;
+
+		// binned SAH builder for the triangles of a mesh
+		struct mesh_builder {
+			static const uint32 bin_count = 12;
+			static const uint32 max_leaf_size = 4;
+
+			vector<aabb> tri_bounds;
+			vector<vec3> centroids;
+			vector<uint32> order;
+			vector<mesh::node>& nodes;
+
+			mesh_builder(vector<mesh::node>& nodes) : nodes(nodes) {}
+
+			uint32 build(uint32 begin, uint32 end, uint32 depth) {
+				uint32 index = (uint32)nodes.size();
+				nodes.push_back(mesh::node());
+
+				aabb b = tri_bounds[order[begin]], cb(centroids[order[begin]], centroids[order[begin]]);
+				for (uint32 i = begin + 1; i < end; ++i) {
+					b.add_aabb(tri_bounds[order[i]]);
+					cb.add_point(centroids[order[i]]);
+				}
+				nodes[index]._min = b._min;
+				nodes[index]._max = b._max;
+
+				uint32 count = end - begin;
+				if (count <= max_leaf_size) {
+					nodes[index].offset = begin;
+					nodes[index].count = (uint16)count;
+					nodes[index].axis = 0;
+					return index;
+				}
+
+				float best_cost = FLT_MAX; uint32 best_axis = 0, best_bin = 0;
+				vec3 ce = cb.extents();
+				for (uint32 axis = 0; axis < 3; ++axis) {
+					if (ce[axis] <= 0.f) continue;
+					aabb bins[bin_count]; uint32 bin_n[bin_count] = { 0 };
+					for (uint32 i = begin; i < end; ++i) {
+						uint32 bi = glm::min(bin_count - 1, (uint32)(bin_count * (centroids[order[i]][axis] - cb._min[axis]) / ce[axis]));
+						bins[bi] = bin_n[bi] == 0 ? tri_bounds[order[i]] : aabb(bins[bi], tri_bounds[order[i]]);
+						bin_n[bi]++;
+					}
+					float right_area[bin_count]; uint32 right_n[bin_count];
+					aabb rb; uint32 rn = 0;
+					for (uint32 i = bin_count - 1; i > 0; --i) {
+						if (bin_n[i] > 0) { rb = rn == 0 ? bins[i] : aabb(rb, bins[i]); rn += bin_n[i]; }
+						right_area[i] = rb.surface_area(); right_n[i] = rn;
+					}
+					aabb lb; uint32 ln = 0;
+					for (uint32 i = 0; i < bin_count - 1; ++i) {
+						if (bin_n[i] > 0) { lb = ln == 0 ? bins[i] : aabb(lb, bins[i]); ln += bin_n[i]; }
+						if (ln == 0 || right_n[i + 1] == 0) continue;
+						float cost = lb.surface_area()*ln + right_area[i + 1] * right_n[i + 1];
+						if (cost < best_cost) {
+							best_cost = cost; best_axis = axis; best_bin = i;
+						}
+					}
+				}
+
+				uint32 mid = begin + count / 2;
+				if (best_cost < FLT_MAX) {
+					auto pmid = partition(order.begin() + begin, order.begin() + end, [&](uint32 t) {
+						uint32 bi = glm::min(bin_count - 1, (uint32)(bin_count * (centroids[t][best_axis] - cb._min[best_axis]) / ce[best_axis]));
+						return bi <= best_bin;
+					});
+					uint32 m = (uint32)(pmid - order.begin());
+					if (m != begin && m != end) mid = m;
+				}
+				if (bvh_too_deep(depth, mid - begin, end - mid)) {
+					// median along the widest spread of centroids
+					best_axis = ce.x >= ce.y && ce.x >= ce.z ? 0 : (ce.y >= ce.z ? 1 : 2);
+					mid = begin + count / 2;
+					nth_element(order.begin() + begin, order.begin() + mid, order.begin() + end, [&](uint32 a, uint32 b) {
+						return centroids[a][best_axis] < centroids[b][best_axis];
+					});
+				}
+
+				nodes[index].axis = (uint16)best_axis;
+				nodes[index].count = 0;
+				build(begin, mid, depth + 1);
+				// nodes can grow while the second child is built, so index into it only afterwards
+				uint32 second = build(mid, end, depth + 1);
+				nodes[index].offset = second;
+				return index;
+			}
+		};
+
+		mesh::mesh(const vector<vec3>& pos, const vector<uvec3>& triangles, const vector<vec3>& nrm, const vector<vec2>& tc) {
+			if (triangles.empty()) throw runtime_error("mesh has no triangles");
+			if (!nrm.empty() && nrm.size() != pos.size()) throw runtime_error("mesh needs one normal per vertex");
+			if (!tc.empty() && tc.size() != pos.size()) throw runtime_error("mesh needs one texcoord per vertex");
+			for (const auto& t : triangles)
+				if (t.x >= pos.size() || t.y >= pos.size() || t.z >= pos.size())
+					throw runtime_error("mesh triangle indexes a vertex that doesn't exist");
+
+			mesh_builder bld(own_nodes);
+			bld.tri_bounds.reserve(triangles.size());
+			bld.centroids.reserve(triangles.size());
+			for (const auto& t : triangles) {
+				aabb b(pos[t.x], pos[t.x]);
+				b.add_point(pos[t.y]);
+				b.add_point(pos[t.z]);
+				bld.tri_bounds.push_back(b);
+				bld.centroids.push_back(b.center());
+				bld.order.push_back((uint32)bld.order.size());
+			}
+			own_nodes.reserve(triangles.size() * 2);
+			bld.build(0, (uint32)triangles.size(), 0);
+
+			// put the triangles in leaf order, then the vertices in order of first use by those triangles
+			vector<uint32> remap(pos.size(), ~0u);
+			own_tris.reserve(triangles.size());
+			for (auto ti : bld.order) {
+				uvec3 t = triangles[ti];
+				for (int k = 0; k < 3; ++k) {
+					if (remap[t[k]] == ~0u) {
+						remap[t[k]] = (uint32)own_positions.size();
+						own_positions.push_back(pos[t[k]]);
+						if (!nrm.empty()) own_normals.push_back(nrm[t[k]]);
+						if (!tc.empty()) own_texcoords.push_back(tc[t[k]]);
+					}
+					t[k] = remap[t[k]];
+				}
+				own_tris.push_back(t);
+			}
+
+			positions = own_positions.data();
+			normals = own_normals.empty() ? nullptr : own_normals.data();
+			texcoords = own_texcoords.empty() ? nullptr : own_texcoords.data();
+			tris = own_tris.data();
+			nodes = own_nodes.data();
+			nvert = (uint32)own_positions.size();
+			ntri = (uint32)own_tris.size();
+			nnode = (uint32)own_nodes.size();
+		}
+
+		shared_ptr<mesh> mesh::load(const string& filename) {
+			auto f = make_shared<mapped_file>(filename);
+			if (f->size() < sizeof(mesh_file_header)) throw runtime_error("invalid mesh file " + filename);
+			const mesh_file_header* h = (const mesh_file_header*)f->data();
+			if (h->magic[0] != 'W' || h->magic[1] != 'H' || h->magic[2] != 'M' || h->magic[3] != '1')
+				throw runtime_error("invalid mesh file " + filename);
+
+			size_t nv = h->vertex_count;
+			size_t expected = sizeof(mesh_file_header) + nv * sizeof(vec3)
+				+ ((h->flags & mesh_has_normals) ? nv * sizeof(vec3) : 0)
+				+ ((h->flags & mesh_has_texcoords) ? nv * sizeof(vec2) : 0)
+				+ (size_t)h->triangle_count * sizeof(uvec3) + (size_t)h->node_count * sizeof(node);
+			if (f->size() < expected || h->triangle_count == 0 || h->node_count == 0)
+				throw runtime_error("truncated mesh file " + filename);
+
+			auto m = shared_ptr<mesh>(new mesh());
+			const uint8_t* p = f->data() + sizeof(mesh_file_header);
+			m->positions = (const vec3*)p; p += nv * sizeof(vec3);
+			m->normals = nullptr; m->texcoords = nullptr;
+			if (h->flags & mesh_has_normals) { m->normals = (const vec3*)p; p += nv * sizeof(vec3); }
+			if (h->flags & mesh_has_texcoords) { m->texcoords = (const vec2*)p; p += nv * sizeof(vec2); }
+			m->tris = (const uvec3*)p; p += h->triangle_count * sizeof(uvec3);
+			m->nodes = (const node*)p;
+			m->nvert = h->vertex_count;
+			m->ntri = h->triangle_count;
+			m->nnode = h->node_count;
+			m->file = f;
+
+			// everything the traversal follows has to stay inside the arrays, and the tree has to fit its stack
+			for (uint32 i = 0; i < m->ntri; ++i) {
+				const uvec3& t = m->tris[i];
+				if (t.x >= m->nvert || t.y >= m->nvert || t.z >= m->nvert)
+					throw runtime_error("invalid triangle in mesh file " + filename);
+			}
+			// children come after their parents, so depths can be worked out in one pass
+			vector<uint8_t> depth(m->nnode, 0);
+			for (uint32 i = 0; i < m->nnode; ++i) {
+				const node& n = m->nodes[i];
+				if (n.count > 0) {
+					if ((uint64_t)n.offset + n.count > m->ntri) throw runtime_error("invalid node in mesh file " + filename);
+					continue;
+				}
+				if (n.axis > 2 || i + 1 >= m->nnode || n.offset <= i + 1 || n.offset >= m->nnode || depth[i] >= bvh_max_depth)
+					throw runtime_error("invalid node in mesh file " + filename);
+				depth[i + 1] = glm::max(depth[i + 1], (uint8_t)(depth[i] + 1));
+				depth[n.offset] = glm::max(depth[n.offset], (uint8_t)(depth[i] + 1));
+			}
+			return m;
+		}
+
+		void mesh::write(const string& filename) const {
+			FILE* f;
+			if (fopen_s(&f, filename.c_str(), "wb") != 0 || f == nullptr)
+				throw runtime_error("couldn't open file " + filename);
+			auto put = [&](const void* data, size_t size, size_t count) {
+				if (fwrite(data, size, count, f) != count) {
+					fclose(f);
+					throw runtime_error("couldn't write mesh file " + filename);
+				}
+			};
+			mesh_file_header h;
+			h.magic[0] = 'W'; h.magic[1] = 'H'; h.magic[2] = 'M'; h.magic[3] = '1';
+			h.vertex_count = nvert; h.triangle_count = ntri; h.node_count = nnode;
+			h.flags = (normals ? mesh_has_normals : 0) | (texcoords ? mesh_has_texcoords : 0);
+			h.reserved[0] = h.reserved[1] = h.reserved[2] = 0;
+			put(&h, sizeof(h), 1);
+			put(positions, sizeof(vec3), nvert);
+			if (normals) put(normals, sizeof(vec3), nvert);
+			if (texcoords) put(texcoords, sizeof(vec2), nvert);
+			put(tris, sizeof(uvec3), ntri);
+			put(nodes, sizeof(node), nnode);
+			if (fclose(f) != 0) throw runtime_error("couldn't write mesh file " + filename);
+		}
+
+		bool mesh::hit(const ray& r, hit_record* hr) const {
+			if (hr == nullptr) return occluded(r, FLT_MAX);
+			float tmax = hr->t;
+			int best = -1; vec2 best_bc;
+			uint32 stack[bvh_stack_size]; uint32 sp = 0;
+			stack[sp++] = 0;
+			while (sp > 0) {
+				uint32 ni = stack[--sp];
+				const node& n = nodes[ni];
+				auto iv = aabb(n._min, n._max).hit_retint(r);
+				if (iv.second < glm::max(iv.first, 0.f) || iv.first > tmax) continue;
+				if (n.count > 0) {
+					for (uint32 i = n.offset; i < n.offset + n.count; ++i) {
+						float t; vec2 bc;
+						if (intersect(r, i, tmax, t, bc)) {
+							tmax = t; best = (int)i; best_bc = bc;
+						}
+					}
+				}
+				else if (r.d[n.axis] < 0.f) {
+					stack[sp++] = ni + 1;
+					stack[sp++] = n.offset;
+				}
+				else {
+					stack[sp++] = n.offset;
+					stack[sp++] = ni + 1;
+				}
+			}
+			if (best < 0) return false;
+
+			const uvec3& tri = tris[best];
+			float w = 1.f - best_bc.x - best_bc.y;
+			vec3 p0 = positions[tri.x], e1 = positions[tri.y] - p0, e2 = positions[tri.z] - p0;
+			vec3 gn = cross(e1, e2);
+			hr->t = tmax;
+			if (normals != nullptr) {
+				hr->norm = normalize(normals[tri.x] * w + normals[tri.y] * best_bc.x + normals[tri.z] * best_bc.y);
+			}
+			else {
+				hr->norm = normalize(gn);
+				if (dot(hr->norm, r.d) > 0.f) hr->norm = -hr->norm;
+			}
+			// gradients of the barycentric coordinates along the plane of the triangle
+			vec3 gb1 = cross(e2, gn) / dot(gn, gn), gb2 = cross(gn, e1) / dot(gn, gn);
+			if (texcoords != nullptr) {
+				vec2 t0 = texcoords[tri.x], d1 = texcoords[tri.y] - t0, d2 = texcoords[tri.z] - t0;
+				hr->texc = t0 + d1 * best_bc.x + d2 * best_bc.y;
+				hr->dudp = gb1 * d1.x + gb2 * d2.x;
+				hr->dvdp = gb1 * d1.y + gb2 * d2.y;
+			}
+			else {
+				hr->texc = best_bc;
+				hr->dudp = gb1;
+				hr->dvdp = gb2;
+			}
+			return true;
+		}
+
+		bool mesh::occluded(const ray& r, float tmax) const {
+			uint32 stack[bvh_stack_size]; uint32 sp = 0;
+			stack[sp++] = 0;
+			while (sp > 0) {
+				uint32 ni = stack[--sp];
+				const node& n = nodes[ni];
+				auto iv = aabb(n._min, n._max).hit_retint(r);
+				if (iv.second < glm::max(iv.first, 0.f) || iv.first > tmax) continue;
+				if (n.count > 0) {
+					float t; vec2 bc;
+					for (uint32 i = n.offset; i < n.offset + n.count; ++i)
+						if (intersect(r, i, tmax, t, bc)) return true;
+				}
+				else {
+					stack[sp++] = n.offset;
+					stack[sp++] = ni + 1;
+				}
+			}
+			return false;
+		}
+
+		aabb mesh::bounds(float, float) const {
+			return aabb(nodes[0]._min, nodes[0]._max);
+		}
+	}
+}
@@ -0,0 +1,91 @@
+#pragma once
+#include "cmmn.h"
+#include "surface.h"
+#include "mapped_file.h"
+
+namespace whrt5 {
+	namespace surfaces {
+		/*
+			an indexed triangle mesh with its own BVH
+
+			triangles are stored in the order of the BVH leaves so that the triangles of a leaf are next to each other,
+			and vertices are stored in order of first use so that the vertices of a leaf are close together as well
+			meshes can be written to a binary file that holds these arrays and the BVH exactly as they are in memory,
+			so loading a mesh only maps the file and points into it, no matter how many triangles it has
+
+			file layout, all little endian:
+				header		"WHM1", vertex count, triangle count, node count, flags (1: normals, 2: texcoords), 3 reserved
+				positions	vertex count * 3 floats
+				normals		vertex count * 3 floats, if flags & 1
+				texcoords	vertex count * 2 floats, if flags & 2
+				triangles	triangle count * 3 uint32 vertex indices
+				nodes		node count * mesh::node
+		*/
+		struct mesh : public surface {
+			struct node {
+				vec3 _min;
+				// interior: index of the second child (the first is right after this node), leaf: index of the first triangle
+				uint32 offset;
+				vec3 _max;
+				// number of triangles in the leaf, 0 for interior nodes
+				uint16 count;
+				// split axis for interior nodes
+				uint16 axis;
+			};
+
+			// build a mesh and its BVH out of vertex arrays and triangles that index into them
+			// normals and texcoords are optional, but if they are given there must be one for every position
+			mesh(const vector<vec3>& positions, const vector<uvec3>& triangles,
+				const vector<vec3>& normals = vector<vec3>(), const vector<vec2>& texcoords = vector<vec2>());
+
+			// open a mesh written by write(), throws runtime_error if the file is not a valid mesh
+			static shared_ptr<mesh> load(const string& filename);
+			// write the mesh, including its BVH, to a file that load() can open
+			void write(const string& filename) const;
+
+			inline uint32 vertex_count() const { return nvert; }
+			inline uint32 triangle_count() const { return ntri; }
+
+			bool hit(const ray& r, hit_record* hr) const override;
+			bool occluded(const ray& r, float tmax) const override;
+			aabb bounds(float t0, float t1) const override;
+		private:
+			mesh() {}
+
+			// these point either into the own_ vectors or into the mapped file
+			const vec3* positions;
+			const vec3* normals;
+			const vec2* texcoords;
+			const uvec3* tris;
+			const node* nodes;
+			uint32 nvert, ntri, nnode;
+
+			vector<vec3> own_positions, own_normals;
+			vector<vec2> own_texcoords;
+			vector<uvec3> own_tris;
+			vector<node> own_nodes;
+			shared_ptr<mapped_file> file;
+
+			// Möller-Trumbore test against triangle i, gives the distance and the barycentric coordinates of the hit
+			inline bool intersect(const ray& r, uint32 i, float tmax, float& t, vec2& bc) const {
+				const uvec3& tri = tris[i];
+				vec3 p0 = positions[tri.x];
+				vec3 e1 = positions[tri.y] - p0, e2 = positions[tri.z] - p0;
+				vec3 pv = cross(r.d, e2);
+				float det = dot(e1, pv);
+				if (abs(det) < 1e-12f) return false;
+				float inv_det = 1.f / det;
+				vec3 tv = r.e - p0;
+				float u = dot(tv, pv) * inv_det;
+				if (u < 0.f || u > 1.f) return false;
+				vec3 qv = cross(tv, e1);
+				float v = dot(r.d, qv) * inv_det;
+				if (v < 0.f || u + v > 1.f) return false;
+				t = dot(e2, qv) * inv_det;
+				if (t <= 0.f || t > tmax) return false;
+				bc = vec2(u, v);
+				return true;
+			}
+		};
+	}
+}
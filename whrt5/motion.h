@@ -55,9 +55,12 @@ namespace motion {
 		map<uint8_t, loc_rot> rest_pos; // position the mallet needs to be in position to hit the target that makes note @ index
 
 		mat4 operator()(float t) {
-			for (int i = 0; i < evt.size() - 1; ++i) {
+			// evt is in time order, so only the last event starting at or before t can be playing
+			size_t i = upper_bound(evt.begin(), evt.end(), t, [](float t, const hit_event& e) { return t < e.time; }) - evt.begin();
+			if (i > 0 && i < evt.size()) {
+				--i;
 				auto e = evt[i];
-				if (t >= e.time && t < e.time + e.duration) {
+				if (t < e.time + e.duration) {
 					//cout << t << " " << e.note << " " << e.duration << endl;
 					float T = t - e.time;
 					float x = T / e.duration;
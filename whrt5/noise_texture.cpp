@@ -0,0 +1,117 @@
+#include "noise_texture.h"
+
+namespace whrt5 {
+	// Perlin's permutation, hashes lattice points
+	static const uint8_t perm[256] = {
+		151,160,137,91,90,15,131,13,201,95,96,53,194,233,7,225,140,36,103,30,69,142,8,99,37,240,21,10,23,190,6,148,
+		247,120,234,75,0,26,197,62,94,252,219,203,117,35,11,32,57,177,33,88,237,149,56,87,174,20,125,136,171,168,68,175,
+		74,165,71,134,139,48,27,166,77,146,158,231,83,111,229,122,60,211,133,230,220,105,92,41,55,46,245,40,244,102,143,54,
+		65,25,63,161,1,216,80,73,209,76,132,187,208,89,18,169,200,196,135,130,116,188,159,86,164,100,109,198,173,186,3,64,
+		52,217,226,250,124,123,5,202,38,147,118,126,255,82,85,212,207,206,59,227,47,16,58,17,182,189,28,42,223,183,170,213,
+		119,248,152,2,44,154,163,70,221,153,101,155,167,43,172,9,129,22,39,253,19,98,108,110,79,113,224,232,178,185,112,104,
+		218,246,97,228,251,34,242,193,238,210,144,12,191,179,162,241,81,51,145,235,249,14,239,107,49,192,214,31,181,199,106,157,
+		184,84,204,176,115,121,50,45,127,4,150,254,138,236,205,93,222,114,67,29,24,72,243,141,128,195,78,66,215,61,156,180
+	};
+
+	static inline int32_t wrap(int32_t i, int32_t period) {
+		i %= period;
+		return i < 0 ? i + period : i;
+	}
+
+	static inline float4 fade(float4 t) {
+		return t*t*t*(t*(t*float4(6.f) - float4(15.f)) + float4(10.f));
+	}
+
+	static inline float4 lerp(float4 a, float4 b, float4 t) {
+		return a + (b - a)*t;
+	}
+
+	// negate a in the lanes where m is set
+	static inline float4 negate_if(__m128i m, float4 a) {
+		return _mm_xor_ps(a.v, _mm_and_ps(_mm_castsi128_ps(m), _mm_set1_ps(-0.f)));
+	}
+
+	static inline __m128i bit_set(__m128i h, int bit) {
+		__m128i b = _mm_set1_epi32(bit);
+		return _mm_cmpeq_epi32(_mm_and_si128(h, b), b);
+	}
+
+	// dot product of the offset (x, y) with one of 8 gradients picked by h
+	static inline float4 grad(__m128i h, float4 x, float4 y) {
+		float4 lo = _mm_castsi128_ps(_mm_cmplt_epi32(_mm_and_si128(h, _mm_set1_epi32(7)), _mm_set1_epi32(4)));
+		float4 u = select(lo, x, y), v = select(lo, y, x);
+		return negate_if(bit_set(h, 1), u) + negate_if(bit_set(h, 2), v*float4(2.f));
+	}
+
+	// dot product of the offset (x, y, z) with one of Perlin's 12 gradients picked by h
+	static inline float4 grad(__m128i h, float4 x, float4 y, float4 z) {
+		h = _mm_and_si128(h, _mm_set1_epi32(15));
+		float4 lo8 = _mm_castsi128_ps(_mm_cmplt_epi32(h, _mm_set1_epi32(8)));
+		float4 lo4 = _mm_castsi128_ps(_mm_cmplt_epi32(h, _mm_set1_epi32(4)));
+		float4 xv = _mm_castsi128_ps(_mm_or_si128(_mm_cmpeq_epi32(h, _mm_set1_epi32(12)), _mm_cmpeq_epi32(h, _mm_set1_epi32(14))));
+		float4 u = select(lo8, x, y), v = select(lo4, y, select(xv, x, z));
+		return negate_if(bit_set(h, 1), u) + negate_if(bit_set(h, 2), v);
+	}
+
+	static inline __m128i load4(const int32_t* p) {
+		return _mm_loadu_si128((const __m128i*)p);
+	}
+
+	float4 gradient_noise(float4 x, float4 y, const noise_lattice4& l) {
+		float4 fx = vfloor(x), fy = vfloor(y);
+		alignas(16) int32_t ix[4], iy[4], h00[4], h10[4], h01[4], h11[4];
+		_mm_store_si128((__m128i*)ix, _mm_cvttps_epi32(fx.v));
+		_mm_store_si128((__m128i*)iy, _mm_cvttps_epi32(fy.v));
+		// hashing the corners is table lookups, one lane at a time
+		for (int i = 0; i < 4; ++i) {
+			int32_t x0 = wrap(ix[i], l.period[0][i]), x1 = wrap(ix[i] + 1, l.period[0][i]);
+			int32_t y0 = wrap(iy[i], l.period[1][i]), y1 = wrap(iy[i] + 1, l.period[1][i]);
+			int32_t s = perm[l.seed[i] & 255];
+			int32_t a0 = perm[(s + x0) & 255], a1 = perm[(s + x1) & 255];
+			h00[i] = perm[(a0 + y0) & 255]; h10[i] = perm[(a1 + y0) & 255];
+			h01[i] = perm[(a0 + y1) & 255]; h11[i] = perm[(a1 + y1) & 255];
+		}
+		x = x - fx; y = y - fy;
+		float4 one(1.f), xm = x - one, ym = y - one;
+		float4 u = fade(x), v = fade(y);
+		float4 n0 = lerp(grad(load4(h00), x, y), grad(load4(h10), xm, y), u);
+		float4 n1 = lerp(grad(load4(h01), x, ym), grad(load4(h11), xm, ym), u);
+		// scaled so that the result stays in about [-1, 1]
+		return lerp(n0, n1, v)*float4(0.507f);
+	}
+
+	float4 gradient_noise(float4 x, float4 y, float4 z, const noise_lattice4& l) {
+		float4 fx = vfloor(x), fy = vfloor(y), fz = vfloor(z);
+		alignas(16) int32_t ix[4], iy[4], iz[4], h[8][4];
+		_mm_store_si128((__m128i*)ix, _mm_cvttps_epi32(fx.v));
+		_mm_store_si128((__m128i*)iy, _mm_cvttps_epi32(fy.v));
+		_mm_store_si128((__m128i*)iz, _mm_cvttps_epi32(fz.v));
+		// corner c is at (c & 1, (c >> 1) & 1, c >> 2)
+		for (int i = 0; i < 4; ++i) {
+			int32_t xs[2] = { wrap(ix[i], l.period[0][i]), wrap(ix[i] + 1, l.period[0][i]) };
+			int32_t ys[2] = { wrap(iy[i], l.period[1][i]), wrap(iy[i] + 1, l.period[1][i]) };
+			int32_t zs[2] = { wrap(iz[i], l.period[2][i]), wrap(iz[i] + 1, l.period[2][i]) };
+			int32_t s = perm[l.seed[i] & 255];
+			for (int c = 0; c < 8; ++c)
+				h[c][i] = perm[(perm[(perm[(s + xs[c & 1]) & 255] + ys[(c >> 1) & 1]) & 255] + zs[c >> 2]) & 255];
+		}
+		x = x - fx; y = y - fy; z = z - fz;
+		float4 one(1.f), xm = x - one, ym = y - one, zm = z - one;
+		float4 u = fade(x), v = fade(y), w = fade(z);
+		float4 n00 = lerp(grad(load4(h[0]), x, y, z), grad(load4(h[1]), xm, y, z), u);
+		float4 n10 = lerp(grad(load4(h[2]), x, ym, z), grad(load4(h[3]), xm, ym, z), u);
+		float4 n01 = lerp(grad(load4(h[4]), x, y, zm), grad(load4(h[5]), xm, y, zm), u);
+		float4 n11 = lerp(grad(load4(h[6]), x, ym, zm), grad(load4(h[7]), xm, ym, zm), u);
+		return lerp(lerp(n00, n10, v), lerp(n01, n11, v), w)*float4(0.936f);
+	}
+
+	shared_ptr<noise_texture<vec2>> make_wood(vec3 light, vec3 dark, float rings) {
+		// a few cells across the grain bend the rings, and fewer along it keep them long
+		return make_shared<noise_texture<vec2>>(light, dark, vec2(3.f, 1.f), noise_pattern::rings, noise_octaves(4), rings, .6f);
+	}
+
+	shared_ptr<noise_texture<vec2>> make_brushed_metal(vec3 base, vec3 streak) {
+		// many cells across v and few along u stretch the noise into streaks
+		return make_shared<noise_texture<vec2>>(base, streak, vec2(2.f, 96.f), noise_pattern::turbulence, noise_octaves(3));
+	}
+}
@@ -0,0 +1,153 @@
+#pragma once
+#include "cmmn.h"
+#include "texture.h"
+#include "packet.h"
+
+namespace whrt5 {
+	// lattice for 4 lanes of gradient noise: lane i repeats every period[a][i] cells along axis a, and seed[i] picks
+	// one of many unrelated noise functions
+	struct noise_lattice4 {
+		int32_t period[3][4];
+		int32_t seed[4];
+	};
+
+	// improved gradient noise in about [-1, 1] at 4 points at once
+	float4 gradient_noise(float4 x, float4 y, const noise_lattice4& l);
+	float4 gradient_noise(float4 x, float4 y, float4 z, const noise_lattice4& l);
+
+	// how the octaves of noise add up
+	struct noise_octaves {
+		// at least 1, the sums are normalized by the total weight of the octaves so there has to be one
+		uint32 count;
+		// frequency and amplitude of each octave relative to the one before it
+		float lacunarity, gain;
+		noise_octaves(uint32 count = 6, float lacunarity = 2.f, float gain = .5f)
+			: count(glm::max(count, 1u)), lacunarity(lacunarity), gain(gain) {}
+	};
+
+	// how noise is turned into a blend between two colors
+	enum class noise_pattern {
+		// the sum of the octaves, soft clouds
+		fbm,
+		// the sum of the absolute value of the octaves, sharp creases like marble veins or worn metal
+		turbulence,
+		// rings that the noise pushes around, wood grain. they run across u in 2D and around the z axis in 3D
+		rings,
+	};
+
+	/*
+		fBm and turbulence made out of gradient noise, over texture coordinates (Tx = vec2) or positions (Tx = vec3)
+		scale is the number of lattice cells per unit in the first octave, and every octave is rounded to a whole
+		number of cells so that the texture repeats at 1 like the image textures do
+		a single lookup works out 4 octaves at a time with SSE and texel_batch works out 4 lookups at a time. for
+		2D textures that are looked up a lot it is still much cheaper to bake_texture them
+	*/
+	template<typename Tx>
+	class noise_texture : public texture<vec3, Tx> {
+		static const int dims = sizeof(Tx) / sizeof(float);
+		// cells per unit of octave k along axis a
+		int32_t period(uint32 k, int a) const {
+			return glm::max(1, (int32_t)floor(scale[a] * pow(octaves.lacunarity, (float)k) + .5f));
+		}
+		// moves each octave's lattice off the others, so they don't all have a zero at the same points
+		static float offset(uint32 k) { return (float)k*0.371f; }
+		float4 noise4(const float4* p, const noise_lattice4& l) const {
+			return dims == 2 ? gradient_noise(p[0], p[1], l) : gradient_noise(p[0], p[1], p[2], l);
+		}
+		// the [0, 1] blend for the sum of the octaves n at ring coordinate rc. the sums are normalized by the octave
+		// weights, which leaves fbm in about [-.5, .5] and turbulence in about [0, .5]
+		float4 shape(float4 n, float4 rc) const {
+			switch (pattern) {
+			case noise_pattern::fbm: return vmin(vmax(n + float4(.5f), float4(0.f)), float4(1.f));
+			case noise_pattern::turbulence: return vmin(n*float4(2.f), float4(1.f));
+			default: {
+				float4 t = rc*float4(rings) + n*float4(warp);
+				return t - vfloor(t);
+			}
+			}
+		}
+	public:
+		vec3 colors[2];
+		Tx scale;
+		noise_pattern pattern;
+		noise_octaves octaves;
+		// number of rings per unit and how far the noise moves them, for noise_pattern::rings
+		float rings, warp;
+
+		noise_texture(vec3 a, vec3 b, Tx scale, noise_pattern pattern = noise_pattern::fbm,
+			noise_octaves octaves = noise_octaves(), float rings = 8.f, float warp = 1.f)
+			: scale(scale), pattern(pattern), octaves(octaves), rings(rings), warp(warp)
+		{
+			colors[0] = a; colors[1] = b;
+		}
+
+		// the blend between the colors at c, in [0, 1]
+		float value(Tx c) const {
+			// lanes are octaves here
+			float4 sum(0.f), norm(0.f);
+			for (uint32 k = 0; k < octaves.count; k += 4) {
+				noise_lattice4 l;
+				alignas(16) float p[3][4] = {}, w[4];
+				for (int i = 0; i < 4; ++i) {
+					uint32 o = glm::min(k + i, octaves.count - 1);
+					for (int a = 0; a < dims; ++a) {
+						l.period[a][i] = period(o, a);
+						p[a][i] = c[a] * (float)l.period[a][i] + offset(o);
+					}
+					l.seed[i] = (int32_t)o;
+					w[i] = k + i < octaves.count ? pow(octaves.gain, (float)(k + i)) : 0.f;
+				}
+				float4 pv[3] = { float4::load(p[0]), float4::load(p[1]), float4::load(p[2]) };
+				float4 n = noise4(pv, l);
+				if (pattern == noise_pattern::turbulence) n = vabs(n);
+				sum = sum + n*float4::load(w);
+				norm = norm + float4::load(w);
+			}
+			float n = (sum[0] + sum[1] + sum[2] + sum[3]) / (norm[0] + norm[1] + norm[2] + norm[3]);
+			return shape(float4(n), float4(ring_coord(c)))[0];
+		}
+
+		vec3 texel(Tx c) const override {
+			return mix(colors[0], colors[1], value(c));
+		}
+
+		void texel_batch(const Tx* c, vec3* out, size_t n) const override {
+			vec3x4 a(colors[0]), d(colors[1] - colors[0]);
+			size_t i = 0;
+			for (; i + 4 <= n; i += 4) {
+				// lanes are lookups here
+				float4 p[3] = { float4(0.f), float4(0.f), float4(0.f) };
+				for (int ax = 0; ax < dims; ++ax) p[ax] = float4(c[i][ax], c[i + 1][ax], c[i + 2][ax], c[i + 3][ax]);
+				float4 sum(0.f);
+				float norm = 0.f, w = 1.f;
+				for (uint32 k = 0; k < octaves.count; ++k, w *= octaves.gain) {
+					noise_lattice4 l;
+					float4 q[3];
+					for (int ax = 0; ax < dims; ++ax) {
+						int32_t per = period(k, ax);
+						for (int j = 0; j < 4; ++j) l.period[ax][j] = per;
+						q[ax] = p[ax] * float4((float)per) + float4(offset(k));
+					}
+					for (int j = 0; j < 4; ++j) l.seed[j] = (int32_t)k;
+					float4 nv = noise4(q, l);
+					if (pattern == noise_pattern::turbulence) nv = vabs(nv);
+					sum = sum + nv*float4(w);
+					norm += w;
+				}
+				float4 rc = dims == 2 ? p[0] : vsqrt(p[0] * p[0] + p[1] * p[1]);
+				vec3x4 col = a + d*shape(sum*float4(1.f / norm), rc);
+				store_rgb4(out + i, col.x, col.y, col.z);
+			}
+			for (; i < n; ++i) out[i] = texel(c[i]);
+		}
+
+	private:
+		static float ring_coord(vec2 c) { return c.x; }
+		static float ring_coord(vec3 c) { return length(vec2(c.x, c.y)); }
+	};
+
+	// a 2D noise texture of wood, with rings across u so that the grain runs along v
+	shared_ptr<noise_texture<vec2>> make_wood(vec3 light, vec3 dark, float rings = 12.f);
+	// a 2D noise texture for brushed metal, streaks along u
+	shared_ptr<noise_texture<vec2>> make_brushed_metal(vec3 base, vec3 streak);
+}
@@ -0,0 +1,113 @@
+#include "packed_texture.h"
+
+namespace whrt5 {
+	uint16_t float_to_half(float f) {
+		uint32 x;
+		memcpy(&x, &f, 4);
+		uint32 sign = (x >> 16) & 0x8000, fe = (x >> 23) & 0xff, m = x & 0x7fffff;
+		if (fe == 0xff) return (uint16_t)(sign | 0x7c00 | (m != 0 ? 0x200 : 0));
+		int e = (int)fe - 127 + 15;
+		if (e >= 31) return (uint16_t)(sign | 0x7c00);
+		if (e <= 0) {
+			// denormal, or zero if it is too small even for that
+			if (e < -10) return (uint16_t)sign;
+			m |= 0x800000;
+			uint32 shift = (uint32)(14 - e);
+			uint32 h = m >> shift;
+			if ((m >> (shift - 1)) & 1) h++;
+			return (uint16_t)(sign | h);
+		}
+		// rounding can carry into the exponent, which is still the right answer
+		uint32 h = sign | ((uint32)e << 10) | (m >> 13);
+		if (m & 0x1000) h++;
+		return (uint16_t)h;
+	}
+
+	const float* srgb_to_linear_table() {
+		static const vector<float> table = []() {
+			vector<float> t(256);
+			for (int i = 0; i < 256; ++i) {
+				float c = (float)i / 255.f;
+				t[i] = c <= 0.04045f ? c / 12.92f : pow((c + 0.055f) / 1.055f, 2.4f);
+			}
+			return t;
+		}();
+		return table.data();
+	}
+
+	namespace texture_formats {
+		void rgb8_srgb::encode(const vec3* px, block& b) {
+			for (int i = 0; i < 3; ++i) {
+				float c = glm::clamp((*px)[i], 0.f, 1.f);
+				c = c <= 0.0031308f ? c*12.92f : 1.055f*pow(c, 1.f / 2.4f) - 0.055f;
+				b.c[i] = (uint8_t)(c*255.f + .5f);
+			}
+		}
+
+		void rgb16f::encode(const vec3* px, block& b) {
+			for (int i = 0; i < 3; ++i)
+				b.c[i] = float_to_half((*px)[i]);
+		}
+
+		uint16_t rgb565::pack(vec3 c) {
+			c = clamp(c, vec3(0.f), vec3(1.f));
+			return (uint16_t)(((uint32)(c.r*31.f + .5f) << 11) | ((uint32)(c.g*63.f + .5f) << 5) | (uint32)(c.b*31.f + .5f));
+		}
+
+		/*
+			the end points are the pixels furthest apart along the principal axis of the block's colors, found with a
+			few rounds of power iteration on their covariance. each pixel then takes the nearest of the four colors
+		*/
+		void bc1::encode(const vec3* px, block& b) {
+			vec3 mean = vec3(0.f), lo = vec3(1.f), hi = vec3(0.f);
+			vec3 p[16];
+			for (int i = 0; i < 16; ++i) {
+				p[i] = clamp(px[i], vec3(0.f), vec3(1.f));
+				mean += p[i];
+				lo = glm::min(lo, p[i]);
+				hi = glm::max(hi, p[i]);
+			}
+			mean /= 16.f;
+			// the covariance is symmetric, so only its upper triangle is kept
+			float xx = 0.f, xy = 0.f, xz = 0.f, yy = 0.f, yz = 0.f, zz = 0.f;
+			for (int i = 0; i < 16; ++i) {
+				vec3 d = p[i] - mean;
+				xx += d.x*d.x; xy += d.x*d.y; xz += d.x*d.z;
+				yy += d.y*d.y; yz += d.y*d.z; zz += d.z*d.z;
+			}
+			vec3 axis = hi - lo;
+			for (int k = 0; k < 4; ++k) {
+				vec3 n = vec3(xx*axis.x + xy*axis.y + xz*axis.z, xy*axis.x + yy*axis.y + yz*axis.z,
+					xz*axis.x + yz*axis.y + zz*axis.z);
+				float l = length(n);
+				if (l < 1e-12f) break;
+				axis = n / l;
+			}
+			int imin = 0, imax = 0;
+			float dmin = FLT_MAX, dmax = -FLT_MAX;
+			for (int i = 0; i < 16; ++i) {
+				float d = dot(p[i], axis);
+				if (d < dmin) { dmin = d; imin = i; }
+				if (d > dmax) { dmax = d; imax = i; }
+			}
+			b.c0 = rgb565::pack(p[imax]);
+			b.c1 = rgb565::pack(p[imin]);
+			b.indices = 0;
+			if (b.c0 == b.c1) return;
+			// c0 > c1 selects the four color mode
+			if (b.c0 < b.c1) swap(b.c0, b.c1);
+			vec3 a = rgb565::unpack(b.c0), c = rgb565::unpack(b.c1);
+			vec3 pal[4] = { a, c, (a*2.f + c) / 3.f, (a + c*2.f) / 3.f };
+			for (int i = 0; i < 16; ++i) {
+				uint32 best = 0;
+				float bd = FLT_MAX;
+				for (uint32 j = 0; j < 4; ++j) {
+					vec3 d = p[i] - pal[j];
+					float dd = dot(d, d);
+					if (dd < bd) { bd = dd; best = j; }
+				}
+				b.indices |= best << (2 * i);
+			}
+		}
+	}
+}
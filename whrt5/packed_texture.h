@@ -0,0 +1,149 @@
+#pragma once
+#include "cmmn.h"
+#include "texture.h"
+
+namespace whrt5 {
+	// IEEE half precision conversions, values too large for a half become infinity
+	uint16_t float_to_half(float f);
+	inline float half_to_float(uint16_t h) {
+		uint32 sign = (uint32)(h & 0x8000) << 16, e = (h >> 10) & 0x1f, m = h & 0x3ff, x;
+		if (e == 0) {
+			// zero or denormal, which is just m * 2^-24
+			float f = (float)m * (1.f / 16777216.f);
+			memcpy(&x, &f, 4);
+			x |= sign;
+		}
+		else if (e == 31) x = sign | 0x7f800000 | (m << 13);
+		else x = sign | ((e + 112) << 23) | (m << 13);
+		float f;
+		memcpy(&f, &x, 4);
+		return f;
+	}
+
+	// sRGB encoded byte -> linear value
+	const float* srgb_to_linear_table();
+
+	/*
+		storage formats for packed_texture2d
+		a format packs square blocks of block_size x block_size pixels into a block, with
+			static void encode(const vec3* px, block& b)	px is the block's pixels row by row
+			static vec3 decode(const block& b, uint32 i)	pixel i of the block, counting row by row
+	*/
+	namespace texture_formats {
+		// 8 bits per channel, sRGB encoded so that dark values keep their precision. 3 bytes per pixel
+		struct rgb8_srgb {
+			static const uint32 block_size = 1;
+			struct block { uint8_t c[3]; };
+			static void encode(const vec3* px, block& b);
+			static inline vec3 decode(const block& b, uint32) {
+				const float* t = srgb_to_linear_table();
+				return vec3(t[b.c[0]], t[b.c[1]], t[b.c[2]]);
+			}
+		};
+
+		// half floats, keeps values outside [0, 1]. 6 bytes per pixel
+		struct rgb16f {
+			static const uint32 block_size = 1;
+			struct block { uint16_t c[3]; };
+			static void encode(const vec3* px, block& b);
+			static inline vec3 decode(const block& b, uint32) {
+				return vec3(half_to_float(b.c[0]), half_to_float(b.c[1]), half_to_float(b.c[2]));
+			}
+		};
+
+		// 5 bits of red, 6 of green and 5 of blue. 2 bytes per pixel
+		struct rgb565 {
+			static const uint32 block_size = 1;
+			struct block { uint16_t c; };
+			static uint16_t pack(vec3 c);
+			static inline vec3 unpack(uint16_t c) {
+				return vec3((float)(c >> 11) / 31.f, (float)((c >> 5) & 0x3f) / 63.f, (float)(c & 0x1f) / 31.f);
+			}
+			static void encode(const vec3* px, block& b) { b.c = pack(*px); }
+			static inline vec3 decode(const block& b, uint32) { return unpack(b.c); }
+		};
+
+		// BC1 (DXT1): 4x4 blocks of two rgb565 end points and a 2 bit index per pixel picking a point on the line
+		// between them. half a byte per pixel
+		struct bc1 {
+			static const uint32 block_size = 4;
+			struct block { uint16_t c0, c1; uint32 indices; };
+			static void encode(const vec3* px, block& b);
+			static inline vec3 decode(const block& b, uint32 i) {
+				vec3 a = rgb565::unpack(b.c0), c = rgb565::unpack(b.c1);
+				switch ((b.indices >> (2 * i)) & 3) {
+				case 0: return a;
+				case 1: return c;
+				case 2: return b.c0 > b.c1 ? (a*2.f + c) / 3.f : (a + c)*.5f;
+				default: return b.c0 > b.c1 ? (a + c*2.f) / 3.f : vec3(0.f);
+				}
+			}
+		};
+	}
+
+	/*
+		a read only 2D texture stored in one of the compact texture_formats and decoded on lookup
+		it is made from a texture2d, along with that texture's mips, and filters the same way
+	*/
+	template<typename F>
+	class packed_texture2d : public texture<vec3, vec2> {
+		vector<typename F::block> blocks;
+		// number of blocks across a row
+		uint32 blocks_x;
+	public:
+		// size of texture in pixels
+		uvec2 size;
+		// packed copies of the source texture's mips
+		vector<shared_ptr<packed_texture2d<F>>> mips;
+
+		packed_texture2d(const texture2d& src) : size(src.size) {
+			const uint32 bs = F::block_size;
+			blocks_x = (size.x + bs - 1) / bs;
+			uint32 blocks_y = (size.y + bs - 1) / bs;
+			blocks.resize((size_t)blocks_x*blocks_y);
+			vec3 px[bs*bs];
+			for (uint32 by = 0; by < blocks_y; ++by) {
+				for (uint32 bx = 0; bx < blocks_x; ++bx) {
+					// blocks that hang off the edge repeat the last row and column
+					for (uint32 i = 0; i < bs*bs; ++i)
+						px[i] = src.pixel(glm::min(uvec2(bx*bs + i % bs, by*bs + i / bs), size - 1u));
+					F::encode(px, blocks[by*blocks_x + bx]);
+				}
+			}
+			for (const auto& m : src.mips)
+				mips.push_back(make_shared<packed_texture2d<F>>(*m));
+		}
+
+		// gets a pixel value from the texture, must be in [0, size)
+		inline vec3 pixel(uvec2 c) const {
+			const uint32 bs = F::block_size;
+			return F::decode(blocks[(c.y / bs)*blocks_x + c.x / bs], (c.y % bs)*bs + c.x % bs);
+		}
+
+		// repeating, unfiltered lookup like texture2d::texel
+		inline vec3 texel(vec2 c) const override {
+			c = mod(c, vec2(1.f));
+			uvec2 ic = floor(c*(vec2)size);
+			return pixel(glm::min(ic, size - 1u));
+		}
+
+		vec3 bilinear(vec2 c) const {
+			return bilinear_filter(size, c, [this](uvec2 p) { return pixel(p); });
+		}
+
+		vec3 texel(vec2 c, vec2 dx, vec2 dy) const override {
+			if (mips.empty()) return texel(c);
+			return trilinear_filter(size, mips.size(), c, dx, dy, [this](size_t l, vec2 c) {
+				return l == 0 ? bilinear(c) : mips[l - 1]->bilinear(c);
+			});
+		}
+		bool filtered() const override { return !mips.empty(); }
+
+		// bytes used by the pixels, mips included
+		size_t memory_size() const {
+			size_t n = blocks.size()*sizeof(typename F::block);
+			for (const auto& m : mips) n += m->memory_size();
+			return n;
+		}
+	};
+}
@@ -0,0 +1,149 @@
+#pragma once
+#include "cmmn.h"
+#include <emmintrin.h>
+
+namespace whrt5 {
+	// number of rays in a packet, one SSE register of floats
+	const int packet_width = 4;
+	const int packet_all = (1 << packet_width) - 1;
+
+	/*
+		4 floats in an SSE register, one for each lane of a ray packet
+		comparisons return masks with every bit set in the lanes where they are true, movemask turns those into
+		the int lane masks that the packet functions pass around
+	*/
+	struct float4 {
+		__m128 v;
+		float4() {}
+		float4(__m128 v) : v(v) {}
+		float4(float s) : v(_mm_set1_ps(s)) {}
+		float4(float a, float b, float c, float d) : v(_mm_setr_ps(a, b, c, d)) {}
+		// load 4 consecutive floats, p doesn't have to be aligned
+		static inline float4 load(const float* p) { return _mm_loadu_ps(p); }
+
+		inline float operator[](int i) const {
+			alignas(16) float f[4];
+			_mm_store_ps(f, v);
+			return f[i];
+		}
+	};
+
+	inline float4 operator+(float4 a, float4 b) { return _mm_add_ps(a.v, b.v); }
+	inline float4 operator-(float4 a, float4 b) { return _mm_sub_ps(a.v, b.v); }
+	inline float4 operator*(float4 a, float4 b) { return _mm_mul_ps(a.v, b.v); }
+	inline float4 operator/(float4 a, float4 b) { return _mm_div_ps(a.v, b.v); }
+	inline float4 operator-(float4 a) { return _mm_xor_ps(a.v, _mm_set1_ps(-0.f)); }
+	inline float4 operator<(float4 a, float4 b) { return _mm_cmplt_ps(a.v, b.v); }
+	inline float4 operator<=(float4 a, float4 b) { return _mm_cmple_ps(a.v, b.v); }
+	inline float4 operator>(float4 a, float4 b) { return _mm_cmpgt_ps(a.v, b.v); }
+	inline float4 operator>=(float4 a, float4 b) { return _mm_cmpge_ps(a.v, b.v); }
+	inline float4 operator&(float4 a, float4 b) { return _mm_and_ps(a.v, b.v); }
+	inline float4 operator|(float4 a, float4 b) { return _mm_or_ps(a.v, b.v); }
+
+	inline float4 vmin(float4 a, float4 b) { return _mm_min_ps(a.v, b.v); }
+	inline float4 vmax(float4 a, float4 b) { return _mm_max_ps(a.v, b.v); }
+	inline float4 vsqrt(float4 a) { return _mm_sqrt_ps(a.v); }
+	inline float4 vabs(float4 a) { return _mm_andnot_ps(_mm_set1_ps(-0.f), a.v); }
+	// floor of values that fit in an int, SSE2 has no rounding instruction so this truncates and then corrects
+	inline float4 vfloor(float4 a) {
+		float4 t = _mm_cvtepi32_ps(_mm_cvttps_epi32(a.v));
+		return t - (float4(1.f) & (a < t));
+	}
+	// pick a in the lanes where m is set and b everywhere else
+	inline float4 select(float4 m, float4 a, float4 b) { return _mm_or_ps(_mm_and_ps(m.v, a.v), _mm_andnot_ps(m.v, b.v)); }
+	inline int movemask(float4 m) { return _mm_movemask_ps(m.v); }
+	// expand an int lane mask into a float4 mask
+	inline float4 lane_mask(int m) {
+		__m128i bits = _mm_setr_epi32(1, 2, 4, 8);
+		return _mm_castsi128_ps(_mm_cmpeq_epi32(_mm_and_si128(_mm_set1_epi32(m), bits), bits));
+	}
+
+	// 4 vec3s stored as one float4 per component
+	struct vec3x4 {
+		float4 x, y, z;
+		vec3x4() {}
+		vec3x4(float4 x, float4 y, float4 z) : x(x), y(y), z(z) {}
+		vec3x4(vec3 v) : x(v.x), y(v.y), z(v.z) {}
+		vec3x4(const vec3* v)
+			: x(v[0].x, v[1].x, v[2].x, v[3].x),
+			  y(v[0].y, v[1].y, v[2].y, v[3].y),
+			  z(v[0].z, v[1].z, v[2].z, v[3].z) {}
+
+		inline vec3 operator[](int i) const {
+			return vec3(x[i], y[i], z[i]);
+		}
+	};
+
+	inline vec3x4 operator+(const vec3x4& a, const vec3x4& b) { return vec3x4(a.x + b.x, a.y + b.y, a.z + b.z); }
+	inline vec3x4 operator-(const vec3x4& a, const vec3x4& b) { return vec3x4(a.x - b.x, a.y - b.y, a.z - b.z); }
+	inline vec3x4 operator*(const vec3x4& a, float4 s) { return vec3x4(a.x*s, a.y*s, a.z*s); }
+	inline float4 dot(const vec3x4& a, const vec3x4& b) { return a.x*b.x + a.y*b.y + a.z*b.z; }
+	inline vec3x4 normalize(const vec3x4& a) { return a * (float4(1.f) / vsqrt(dot(a, a))); }
+	inline vec3x4 select(float4 m, const vec3x4& a, const vec3x4& b) {
+		return vec3x4(select(m, a.x, b.x), select(m, a.y, b.y), select(m, a.z, b.z));
+	}
+
+	// load 4 consecutive vec2s and split them into one float4 per component
+	inline void load_vec2x4(const vec2* p, float4& x, float4& y) {
+		__m128 a = _mm_loadu_ps(&p[0].x), b = _mm_loadu_ps(&p[2].x);
+		x = _mm_shuffle_ps(a, b, _MM_SHUFFLE(2, 0, 2, 0));
+		y = _mm_shuffle_ps(a, b, _MM_SHUFFLE(3, 1, 3, 1));
+	}
+
+	// load 4 consecutive RGB pixels and split them into one float4 per channel
+	inline void load_rgb4(const vec3* p, float4& r, float4& g, float4& b) {
+		const float* f = &p[0].x;
+		__m128 a = _mm_loadu_ps(f), c = _mm_loadu_ps(f + 4), d = _mm_loadu_ps(f + 8);
+		// a = r0 g0 b0 r1, c = g1 b1 r2 g2, d = b2 r3 g3 b3
+		r = _mm_shuffle_ps(a, _mm_shuffle_ps(c, d, _MM_SHUFFLE(1, 1, 2, 2)), _MM_SHUFFLE(2, 0, 3, 0));
+		g = _mm_shuffle_ps(_mm_shuffle_ps(a, c, _MM_SHUFFLE(0, 0, 1, 1)), _mm_shuffle_ps(c, d, _MM_SHUFFLE(2, 2, 3, 3)), _MM_SHUFFLE(2, 0, 2, 0));
+		b = _mm_shuffle_ps(_mm_shuffle_ps(a, c, _MM_SHUFFLE(1, 1, 2, 2)), _mm_shuffle_ps(d, d, _MM_SHUFFLE(3, 3, 0, 0)), _MM_SHUFFLE(2, 0, 2, 0));
+	}
+
+	// the reverse of load_rgb4, interleave one float4 per channel into 4 consecutive RGB pixels
+	inline void store_rgb4(vec3* p, float4 r, float4 g, float4 b) {
+		float* f = &p[0].x;
+		__m128 rg0 = _mm_unpacklo_ps(r.v, g.v), rg1 = _mm_unpackhi_ps(r.v, g.v);
+		// rg0 = r0 g0 r1 g1, rg1 = r2 g2 r3 g3
+		_mm_storeu_ps(f, _mm_shuffle_ps(rg0, _mm_shuffle_ps(b.v, r.v, _MM_SHUFFLE(1, 1, 0, 0)), _MM_SHUFFLE(2, 0, 1, 0)));
+		_mm_storeu_ps(f + 4, _mm_shuffle_ps(_mm_shuffle_ps(g.v, b.v, _MM_SHUFFLE(1, 1, 1, 1)), rg1, _MM_SHUFFLE(1, 0, 2, 0)));
+		_mm_storeu_ps(f + 8, _mm_shuffle_ps(_mm_shuffle_ps(b.v, r.v, _MM_SHUFFLE(3, 3, 2, 2)), _mm_shuffle_ps(g.v, b.v, _MM_SHUFFLE(3, 3, 3, 3)), _MM_SHUFFLE(2, 0, 2, 0)));
+	}
+
+	// a packet of rays, one per lane
+	struct ray4 {
+		vec3x4 e, d;
+		float time[packet_width];
+
+		ray4() {}
+		ray4(const vec3x4& e, const vec3x4& d, const float* t) : e(e), d(d) {
+			for (int i = 0; i < packet_width; ++i) time[i] = t[i];
+		}
+		// pack 4 rays
+		ray4(const ray* r)
+			: e(vec3x4(float4(r[0].e.x, r[1].e.x, r[2].e.x, r[3].e.x), float4(r[0].e.y, r[1].e.y, r[2].e.y, r[3].e.y), float4(r[0].e.z, r[1].e.z, r[2].e.z, r[3].e.z))),
+			  d(vec3x4(float4(r[0].d.x, r[1].d.x, r[2].d.x, r[3].d.x), float4(r[0].d.y, r[1].d.y, r[2].d.y, r[3].d.y), float4(r[0].d.z, r[1].d.z, r[2].d.z, r[3].d.z))) {
+			for (int i = 0; i < packet_width; ++i) time[i] = r[i].time;
+		}
+
+		inline vec3x4 operator ()(float4 t) const {
+			return e + d*t;
+		}
+
+		// get the ray in lane i
+		inline ray operator[](int i) const {
+			return ray(e[i], d[i], time[i]);
+		}
+	};
+
+	// packet version of aabb::hit_retint, finds the lanes in mask whose interval in the box overlaps [0, tmax]
+	// inv_d is 1/r.d, which callers testing many boxes should compute once
+	inline int hit4(const aabb& b, const ray4& r, const vec3x4& inv_d, float4 tmax, int mask) {
+		float4 t1x = (float4(b._min.x) - r.e.x) * inv_d.x, t2x = (float4(b._max.x) - r.e.x) * inv_d.x;
+		float4 t1y = (float4(b._min.y) - r.e.y) * inv_d.y, t2y = (float4(b._max.y) - r.e.y) * inv_d.y;
+		float4 t1z = (float4(b._min.z) - r.e.z) * inv_d.z, t2z = (float4(b._max.z) - r.e.z) * inv_d.z;
+		float4 tmin = vmax(vmax(vmin(t1x, t2x), vmin(t1y, t2y)), vmax(vmin(t1z, t2z), float4(0.f)));
+		float4 tfar = vmin(vmin(vmax(t1x, t2x), vmax(t1y, t2y)), vmin(vmax(t1z, t2z), tmax));
+		return movemask(tmin <= tfar) & mask;
+	}
+}
@@ -0,0 +1,56 @@
+#include "pipeline.h"
+
+namespace whrt5 {
+	render_pipeline::render_pipeline(uvec2 frame_size, uint32 depth, texture_layout layout) {
+		if (depth < 2) depth = 2;
+		for (uint32 i = 0; i < depth; ++i)
+			buffers.push_back(texture2d(frame_size, layout));
+	}
+
+	void render_pipeline::run(uint32 frame_count, function<void(texture2d&, uint32)> render,
+		function<void(const texture2d&, uint32)> encode)
+	{
+		// buffer indices that can be rendered into, and (buffer, frame) pairs waiting for the encoder
+		bounded_queue<uint32> free_buffers(buffers.size());
+		bounded_queue<pair<uint32, uint32>> finished(buffers.size());
+		for (uint32 i = 0; i < buffers.size(); ++i) free_buffers.push(i);
+
+		const uint32 stop = ~0u;
+		exception_ptr encode_error;
+		atomic<bool> encode_failed(false);
+		thread encoder([&]() {
+			while (true) {
+				auto f = finished.pop();
+				if (f.first == stop) break;
+				if (!encode_failed) {
+					try {
+						encode(buffers[f.first], f.second);
+					}
+					catch (...) {
+						encode_error = current_exception();
+						encode_failed = true;
+					}
+				}
+				free_buffers.push(f.first);
+			}
+		});
+
+		exception_ptr render_error;
+		try {
+			for (uint32 i = 0; i < frame_count; ++i) {
+				uint32 b = free_buffers.pop();
+				if (encode_failed) break;
+				render(buffers[b], i);
+				finished.push(make_pair(b, i));
+			}
+		}
+		catch (...) {
+			render_error = current_exception();
+		}
+		finished.push(make_pair(stop, 0u));
+		encoder.join();
+
+		if (render_error) rethrow_exception(render_error);
+		if (encode_error) rethrow_exception(encode_error);
+	}
+}
@@ -0,0 +1,53 @@
+#pragma once
+#include "cmmn.h"
+#include "texture.h"
+#include <condition_variable>
+#include <atomic>
+
+namespace whrt5 {
+	// a FIFO queue that holds at most capacity items, push blocks while it is full and pop blocks while it is empty
+	template<typename T>
+	class bounded_queue {
+		queue<T> items;
+		size_t capacity;
+		mutex m;
+		condition_variable not_full, not_empty;
+	public:
+		bounded_queue(size_t capacity) : capacity(capacity) {}
+
+		void push(T v) {
+			unique_lock<mutex> lk(m);
+			not_full.wait(lk, [&]() { return items.size() < capacity; });
+			items.push(move(v));
+			not_empty.notify_one();
+		}
+
+		T pop() {
+			unique_lock<mutex> lk(m);
+			not_empty.wait(lk, [&]() { return !items.empty(); });
+			T v = move(items.front());
+			items.pop();
+			not_full.notify_one();
+			return v;
+		}
+	};
+
+	/*
+		renders an animation while another thread encodes the frames that are already finished, so the encoder runs
+		at the same time as the render of the next frame instead of after it
+		frames are rendered into a ring of depth buffers. once every buffer is either waiting for the encoder or being
+		encoded the renderer waits for one to be handed back, which keeps the encoder from falling arbitrarily behind
+	*/
+	class render_pipeline {
+		vector<texture2d> buffers;
+	public:
+		// the buffers are textures of size frame_size stored in layout
+		render_pipeline(uvec2 frame_size, uint32 depth = 3, texture_layout layout = texture_layout::linear);
+
+		// render(rt, i) is called for each frame i in [0, frame_count) on the calling thread and encode(rt, i) is called
+		// with the result on the encoder thread, in the same order
+		// if encode throws, rendering stops and the exception is rethrown here
+		void run(uint32 frame_count, function<void(texture2d&, uint32)> render,
+			function<void(const texture2d&, uint32)> encode);
+	};
+}
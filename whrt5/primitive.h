@@ -0,0 +1,321 @@
+#pragma once
+#include "cmmn.h"
+#include "texture.h"
+#include "packet.h"
+#include "surface.h"
+#include "bvh.h"
+
+namespace whrt5 {
+	struct material {
+		shared_ptr<texture<vec3, vec2>> tex;
+		float reflect;
+
+		material(shared_ptr<texture<vec3, vec2>> t, float ref = 0.f) : tex(t), reflect(ref) {}
+	};
+	struct hit_record : public surfaces::hit_record {
+		shared_ptr<material> mat;
+	};
+	// hit records for a packet of rays, materials are borrowed from the primitives that own them
+	struct hit_record4 : public surfaces::hit_record4 {
+		material* mat[packet_width];
+		hit_record4() {
+			for (int i = 0; i < packet_width; ++i) mat[i] = nullptr;
+		}
+
+		inline void set_lane(int i, const hit_record& h) {
+			surfaces::hit_record4::set_lane(i, h);
+			mat[i] = h.mat.get();
+		}
+	};
+	struct primitive {
+		virtual bool hit(const ray& r, hit_record* hr) const = 0;
+		// check if the primitive is hit along r before tmax, stopping at the first hit found
+		virtual bool occluded(const ray& r, float tmax) const = 0;
+
+		// packet version of hit, only the lanes in mask are tested
+		// returns the lanes whose hit record was updated, by default each lane is sent through hit() on its own
+		virtual int hit4(const ray4& r, int mask, hit_record4& hr) const {
+			int hits = 0;
+			for (int i = 0; i < packet_width; ++i) {
+				if (!(mask & (1 << i))) continue;
+				hit_record h; h.t = hr.t[i];
+				if (hit(r[i], &h)) {
+					hr.set_lane(i, h);
+					hits |= 1 << i;
+				}
+			}
+			return hits;
+		}
+		// packet version of occluded, returns the lanes in mask that hit the primitive before tmax
+		virtual int occluded4(const ray4& r, int mask, float4 tmax) const {
+			int occ = 0;
+			for (int i = 0; i < packet_width; ++i)
+				if ((mask & (1 << i)) && occluded(r[i], tmax[i])) occ |= 1 << i;
+			return occ;
+		}
+
+		// bounds of the primitive in world space for any time in [t0, t1], aabb::infinite() if it can't be bounded
+		virtual aabb bounds(float t0, float t1) const = 0;
+		// called before rays with times in [t0, t1] are traced, so acceleration structures can be updated
+		virtual void prepare(float, float) {}
+		// true if the primitive moves or changes over time
+		virtual bool dynamic() const { return false; }
+		// add the bounds over [t0, t1] of each part of the primitive that moves to out
+		// a ray that misses all of them sees the same static geometry at any time
+		virtual void moving_bounds(float t0, float t1, vector<aabb>& out) const {
+			if (dynamic()) out.push_back(bounds(t0, t1));
+		}
+	};
+	struct surface_primitive : public primitive {
+		shared_ptr<material> mat;
+		shared_ptr<surfaces::surface> surf;
+
+		surface_primitive(shared_ptr<surfaces::surface> surf, shared_ptr<material> m)
+			: surf(surf), mat(m) {
+		}
+
+		bool hit(const ray& r, hit_record* hr) const {
+			if (surf->hit(r, hr)) {
+				hr->mat = mat;
+				return true;
+			}
+			return false;
+		}
+
+		bool occluded(const ray& r, float tmax) const {
+			return surf->occluded(r, tmax);
+		}
+
+		int hit4(const ray4& r, int mask, hit_record4& hr) const {
+			int hits = surf->hit4(r, mask, hr);
+			for (int i = 0; i < packet_width; ++i)
+				if (hits & (1 << i)) hr.mat[i] = mat.get();
+			return hits;
+		}
+
+		int occluded4(const ray4& r, int mask, float4 tmax) const {
+			return surf->occluded4(r, mask, tmax);
+		}
+
+		aabb bounds(float t0, float t1) const {
+			return surf->bounds(t0, t1);
+		}
+
+		void prepare(float t0, float t1) {
+			surf->prepare(t0, t1);
+		}
+
+		bool dynamic() const {
+			return surf->dynamic();
+		}
+	};
+
+	/*
+		an instance of a primitive placed by a transform
+		a static child is only prepared once, so a BVH under it is a bottom level tree that gets built once
+		and is reused every frame, while the instance's bounds are recomputed from the cached local bounds
+	*/
+	struct transform_primitive : public primitive {
+		shared_ptr<primitive> p;
+		animated<mat4> transform;
+		aabb local_bounds;
+		bool prepared;
+
+		transform_primitive(shared_ptr<primitive> p, animated<mat4> t) : p(p), transform(t), prepared(false) {}
+
+		// normals and texture gradients are covectors, so they go back to world space through the transpose of the
+		// inverse transform t
+		static inline void to_world(const mat4& t, vec3& norm, vec3& dudp, vec3& dvdp) {
+			mat3 nt = transpose(mat3(t));
+			norm = normalize(nt*norm);
+			dudp = nt*dudp;
+			dvdp = nt*dvdp;
+		}
+
+		bool hit(const ray& r, hit_record* hr) const {
+			auto t = inverse(transform(r.time));
+			auto R = ray(t*vec4(r.e, 1.f), t*vec4(r.d, 0.f), r.time);
+			if (hr == nullptr) return p->hit(R, nullptr);
+			hit_record h; h.t = hr->t;
+			if (!p->hit(R, &h) || !(h.t < hr->t)) return false;
+			to_world(t, h.norm, h.dudp, h.dvdp);
+			*hr = h;
+			return true;
+		}
+
+		bool occluded(const ray& r, float tmax) const {
+			auto t = inverse(transform(r.time));
+			auto R = ray(t*vec4(r.e, 1.f), t*vec4(r.d, 0.f), r.time);
+			return p->occluded(R, tmax);
+		}
+
+		// move each active lane of a packet into the child's space, the transform can be different in every lane
+		// the inverse transform of each lane goes to inv if it is given
+		ray4 to_local(const ray4& r, int mask, mat4* inv = nullptr) const {
+			ray rs[packet_width];
+			for (int i = 0; i < packet_width; ++i) {
+				rs[i] = r[i];
+				if (!(mask & (1 << i))) continue;
+				auto t = inverse(transform(r.time[i]));
+				rs[i] = ray(t*vec4(rs[i].e, 1.f), t*vec4(rs[i].d, 0.f), r.time[i]);
+				if (inv != nullptr) inv[i] = t;
+			}
+			return ray4(rs);
+		}
+
+		int hit4(const ray4& r, int mask, hit_record4& hr) const {
+			mat4 inv[packet_width];
+			hit_record4 h; h.t = hr.t;
+			int hits = p->hit4(to_local(r, mask, inv), mask, h) & movemask(h.t < hr.t);
+			if (hits == 0) return 0;
+			hr.t = select(lane_mask(hits), h.t, hr.t);
+			vec3 n[packet_width];
+			for (int i = 0; i < packet_width; ++i) {
+				n[i] = hr.norm[i];
+				if (!(hits & (1 << i))) continue;
+				n[i] = h.norm[i];
+				hr.texc[i] = h.texc[i];
+				hr.dudp[i] = h.dudp[i];
+				hr.dvdp[i] = h.dvdp[i];
+				hr.mat[i] = h.mat[i];
+				to_world(inv[i], n[i], hr.dudp[i], hr.dvdp[i]);
+			}
+			hr.norm = vec3x4(n);
+			return hits;
+		}
+
+		int occluded4(const ray4& r, int mask, float4 tmax) const {
+			return p->occluded4(to_local(r, mask), mask, tmax);
+		}
+
+		aabb bounds(float t0, float t1) const {
+			return transform.bounds(prepared ? local_bounds : p->bounds(t0, t1), t0, t1);
+		}
+
+		void prepare(float t0, float t1) {
+			if (prepared && !p->dynamic()) return;
+			p->prepare(t0, t1);
+			local_bounds = p->bounds(t0, t1);
+			prepared = true;
+		}
+
+		bool dynamic() const {
+			return !transform.const_val || p->dynamic();
+		}
+
+		void moving_bounds(float t0, float t1, vector<aabb>& out) const {
+			if (!transform.const_val) {
+				out.push_back(bounds(t0, t1));
+				return;
+			}
+			size_t first = out.size();
+			p->moving_bounds(t0, t1, out);
+			for (size_t i = first; i < out.size(); ++i) out[i] = place(out[i], transform.cv);
+		}
+	};
+
+	struct pgroup : public primitive {
+		vector<shared_ptr<primitive>> objs;
+		pgroup(vector<shared_ptr<primitive>> s) : objs(s) {}
+		pgroup(initializer_list<shared_ptr<primitive>> s) : objs(s.begin(), s.end()) {}
+
+		bool hit(const ray& r, hit_record* hr) const override {
+			if (hr == nullptr) return occluded(r, FLT_MAX);
+			hit_record low; bool hit = false;
+			for (const auto s : objs) {
+				hit_record thr;
+				if (s->hit(r, &thr)) {
+					if (thr.t < low.t) low = thr;
+					hit = true;
+				}
+			}
+			if (low.t < hr->t) *hr = low;
+			return hit;
+		}
+
+		bool occluded(const ray& r, float tmax) const override {
+			for (const auto& o : objs)
+				if (o->occluded(r, tmax)) return true;
+			return false;
+		}
+
+		int hit4(const ray4& r, int mask, hit_record4& hr) const override {
+			int hits = 0;
+			for (const auto& o : objs)
+				hits |= o->hit4(r, mask, hr);
+			return hits;
+		}
+
+		int occluded4(const ray4& r, int mask, float4 tmax) const override {
+			int occ = 0;
+			for (const auto& o : objs) {
+				occ |= o->occluded4(r, mask & ~occ, tmax);
+				if (occ == mask) break;
+			}
+			return occ;
+		}
+
+		aabb bounds(float t0, float t1) const override {
+			if (objs.empty()) return aabb();
+			aabb b = objs[0]->bounds(t0, t1);
+			for (const auto& o : objs) b = aabb(b, o->bounds(t0, t1));
+			return b;
+		}
+
+		void prepare(float t0, float t1) override {
+			for (const auto& o : objs) o->prepare(t0, t1);
+		}
+
+		bool dynamic() const override {
+			return any_of(objs.begin(), objs.end(), [](const shared_ptr<primitive>& o) { return o->dynamic(); });
+		}
+
+		void moving_bounds(float t0, float t1, vector<aabb>& out) const override {
+			for (const auto& o : objs) o->moving_bounds(t0, t1, out);
+		}
+	};
+
+	/*
+		a group of primitives that is tested against a ray through a BVH instead of one by one
+		used over transform_primitive instances it is the top level of a two level structure: each frame only
+		the instances that move are re-bounded and the tree is refit above them
+	*/
+	struct bvh_primitive : public primitive {
+		bvh<primitive, hit_record> tree;
+		bvh_primitive(const vector<shared_ptr<primitive>>& s) : tree(s) {}
+		bvh_primitive(initializer_list<shared_ptr<primitive>> s) : tree(vector<shared_ptr<primitive>>(s.begin(), s.end())) {}
+
+		bool hit(const ray& r, hit_record* hr) const override {
+			return tree.hit(r, hr);
+		}
+
+		bool occluded(const ray& r, float tmax) const override {
+			return tree.occluded(r, tmax);
+		}
+
+		int hit4(const ray4& r, int mask, hit_record4& hr) const override {
+			return tree.hit4(r, mask, hr);
+		}
+
+		int occluded4(const ray4& r, int mask, float4 tmax) const override {
+			return tree.occluded4(r, mask, tmax);
+		}
+
+		aabb bounds(float, float) const override {
+			return tree.bounds();
+		}
+
+		void prepare(float t0, float t1) override {
+			tree.update(t0, t1);
+		}
+
+		bool dynamic() const override {
+			return tree.dynamic();
+		}
+
+		void moving_bounds(float t0, float t1, vector<aabb>& out) const override {
+			for (const auto& o : tree.objects())
+				if (o->dynamic()) o->moving_bounds(t0, t1, out);
+		}
+	};
+}
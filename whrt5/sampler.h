@@ -0,0 +1,192 @@
+#pragma once
+#include "cmmn.h"
+#include <cassert>
+
+namespace whrt5 {
+	// identifies one sample out of count samples taken in pixel px of a frame
+	struct sample_id {
+		uint32 frame;
+		uvec2 px;
+		uint32 index, count;
+		sample_id(uint32 frame, uvec2 px, uint32 index, uint32 count)
+			: frame(frame), px(px), index(index), count(count) {}
+	};
+
+	/*
+		generates the values of every sampled dimension of a pixel sample, in [0,1)
+		samplers are stateless so that one sampler can be shared by every render thread, the values only depend on
+		the sample_id and the dimension
+		the renderer uses dimensions in this order: pixel position (2D), shutter time (1D), lens position (2D), and
+		anything after that (light samples and so on) takes the following dimensions
+	*/
+	class sampler {
+	public:
+		virtual ~sampler() {}
+		virtual float get1d(const sample_id& id, uint32 dim) const = 0;
+		// 2D samples take dimensions dim and dim+1 and are stratified together
+		virtual vec2 get2d(const sample_id& id, uint32 dim) const = 0;
+	protected:
+		// hash that decorrelates the pixels, frames and dimensions
+		static inline uint32 seed(const sample_id& id, uint32 dim) {
+			return rnd::stream(id.frame, id.px, 0).at(dim);
+		}
+	};
+
+	// walks through the dimensions of one sample in order
+	struct sample_cursor {
+		const sampler& smp;
+		sample_id id;
+		uint32 dim;
+
+		sample_cursor(const sampler& smp, const sample_id& id) : smp(smp), id(id), dim(0) {}
+
+		inline float get1d() { return smp.get1d(id, dim++); }
+		inline vec2 get2d() {
+			vec2 v = smp.get2d(id, dim);
+			dim += 2;
+			return v;
+		}
+	};
+
+	namespace samplers {
+		/*
+			jittered strata, every dimension (or pair of dimensions) is split into count strata and each sample takes
+			one of them. the strata are shuffled differently in each dimension so that the dimensions aren't correlated
+			pairs are split into the squarest grid with exactly count cells, so that no cell goes unsampled. when count
+			is prime that grid is a single row, so x and y are each split into count strata and shuffled separately
+		*/
+		class stratified : public sampler {
+			// Kensler's hashed permutation, the position of i in a random permutation of [0,l) chosen by p
+			static inline uint32 permute(uint32 i, uint32 l, uint32 p) {
+				uint32 w = l - 1;
+				w |= w >> 1; w |= w >> 2; w |= w >> 4; w |= w >> 8; w |= w >> 16;
+				do {
+					i ^= p; i *= 0xe170893d; i ^= p >> 16; i ^= (i & w) >> 4;
+					i ^= p >> 8; i *= 0x0929eb3f; i ^= p >> 23; i ^= (i & w) >> 1;
+					i *= 1 | p >> 27; i *= 0x6935fa69; i ^= (i & w) >> 11;
+					i *= 0x74dcb303; i ^= (i & w) >> 2; i *= 0x9e501cc3;
+					i ^= (i & w) >> 2; i *= 0xc860a3df; i &= w; i ^= i >> 5;
+				} while (i >= l);
+				return (i + p) % l;
+			}
+		public:
+			float get1d(const sample_id& id, uint32 dim) const override {
+				uint32 s = seed(id, dim);
+				uint32 stratum = permute(id.index, id.count, s);
+				float jitter = rnd::to_unit((uint32)rnd::mix(s ^ ((uint64_t)id.index << 32)));
+				return glm::min((stratum + jitter) / (float)id.count, 1.f - FLT_EPSILON);
+			}
+
+			// the largest divisor of count that is at most sqrt(count), the number of columns of the grid
+			static inline uint32 grid_columns(uint32 count) {
+				uint32 nx = glm::max(1u, (uint32)sqrt((float)count));
+				while (count % nx != 0) --nx;
+				return nx;
+			}
+
+			vec2 get2d(const sample_id& id, uint32 dim) const override {
+				uint32 s = seed(id, dim);
+				uint32 nx = grid_columns(id.count), ny = id.count / nx;
+				// the shuffle only picks cells below count, so the grid has to have exactly that many
+				assert(nx * ny == id.count);
+				uvec2 cell;
+				if (nx == 1) {
+					cell = uvec2(permute(id.index, id.count, s), permute(id.index, id.count, (uint32)(rnd::mix(s) >> 32)));
+					nx = ny;
+				}
+				else {
+					uint32 c = permute(id.index, id.count, s);
+					cell = uvec2(c % nx, c / nx);
+				}
+				uint64_t j = rnd::mix(s ^ ((uint64_t)id.index << 32));
+				vec2 jitter = vec2(rnd::to_unit((uint32)j), rnd::to_unit((uint32)(j >> 32)));
+				return glm::min((vec2(cell) + jitter) / vec2(nx, ny), vec2(1.f - FLT_EPSILON));
+			}
+		};
+
+		/*
+			the Halton sequence, dimension d is the radical inverse of the sample index in the d-th prime base
+			each pixel gets a random toroidal shift of the sequence so that neighbouring pixels don't share a pattern
+		*/
+		class halton : public sampler {
+			static inline float radical_inverse(uint32 base, uint32 i) {
+				float inv_base = 1.f / (float)base, f = inv_base, r = 0.f;
+				while (i > 0) {
+					r += (float)(i % base) * f;
+					i /= base;
+					f *= inv_base;
+				}
+				return r;
+			}
+			static inline float shifted(float x, uint32 s) {
+				x += rnd::to_unit(s);
+				return x >= 1.f ? x - 1.f : x;
+			}
+		public:
+			float get1d(const sample_id& id, uint32 dim) const override {
+				static const uint32 primes[] = {
+					2, 3, 5, 7, 11, 13, 17, 19, 23, 29, 31, 37, 41, 43, 47, 53,
+					59, 61, 67, 71, 73, 79, 83, 89, 97, 101, 103, 107, 109, 113, 127, 131
+				};
+				return shifted(radical_inverse(primes[dim % 32], id.index), seed(id, dim));
+			}
+
+			vec2 get2d(const sample_id& id, uint32 dim) const override {
+				return vec2(get1d(id, dim), get1d(id, dim + 1));
+			}
+		};
+
+		/*
+			Owen-scrambled Sobol points using Burley's hash based scrambling
+			every 1D or 2D request uses the first one or two Sobol dimensions, which are well stratified for any
+			power of two number of samples. the sample order is shuffled for each request so that the dimensions
+			are independent of each other ("padding"), and the points are Owen-scrambled per pixel
+		*/
+		class sobol : public sampler {
+			static inline uint32 reverse_bits(uint32 x) {
+				x = ((x >> 1) & 0x55555555u) | ((x & 0x55555555u) << 1);
+				x = ((x >> 2) & 0x33333333u) | ((x & 0x33333333u) << 2);
+				x = ((x >> 4) & 0x0f0f0f0fu) | ((x & 0x0f0f0f0fu) << 4);
+				x = ((x >> 8) & 0x00ff00ffu) | ((x & 0x00ff00ffu) << 8);
+				return (x >> 16) | (x << 16);
+			}
+			static inline uint32 laine_karras_permutation(uint32 x, uint32 seed) {
+				x += seed;
+				x ^= x * 0x6c50b47cu;
+				x ^= x * 0xb82f1e52u;
+				x ^= x * 0xc7afe638u;
+				x ^= x * 0x8d22f6e6u;
+				return x;
+			}
+			static inline uint32 nested_uniform_scramble(uint32 x, uint32 seed) {
+				return reverse_bits(laine_karras_permutation(reverse_bits(x), seed));
+			}
+			static inline uint32 next_seed(uint32 s) {
+				return (uint32)(rnd::mix(s) >> 32);
+			}
+			// second Sobol dimension, the first is reverse_bits(i)
+			static inline uint32 sobol1(uint32 i) {
+				uint32 v = 1u << 31, r = 0;
+				for (; i != 0; i >>= 1, v ^= v >> 1)
+					if (i & 1) r ^= v;
+				return r;
+			}
+		public:
+			float get1d(const sample_id& id, uint32 dim) const override {
+				uint32 s = seed(id, dim);
+				uint32 i = nested_uniform_scramble(id.index, s);
+				return rnd::to_unit(nested_uniform_scramble(reverse_bits(i), next_seed(s)));
+			}
+
+			vec2 get2d(const sample_id& id, uint32 dim) const override {
+				uint32 s = seed(id, dim);
+				uint32 i = nested_uniform_scramble(id.index, s);
+				s = next_seed(s);
+				uint32 x = nested_uniform_scramble(reverse_bits(i), s);
+				s = next_seed(s);
+				uint32 y = nested_uniform_scramble(sobol1(i), s);
+				return vec2(rnd::to_unit(x), rnd::to_unit(y));
+			}
+		};
+	}
+}
@@ -1,6 +1,8 @@
 #pragma once
 #include "cmmn.h"
 #include "texture.h"
+#include "packet.h"
+#include "bvh.h"
 
 namespace whrt5 {
 	namespace surfaces {
@@ -8,10 +10,71 @@ namespace whrt5 {
 			float t;
 			vec3 norm;
 			vec2 texc;
-			hit_record() : t(10000.f) {}
+			// how the texture coordinates change as the hit point moves along the surface, zero if they aren't known
+			vec3 dudp, dvdp;
+			hit_record() : t(10000.f), dudp(0.f), dvdp(0.f) {}
 		};
+
+		// texture gradients of the planar mapping texc = cross(p, n).xz used by disks and boxes
+		inline void planar_texgrad(vec3 n, vec3& dudp, vec3& dvdp) {
+			dudp = vec3(0.f, n.z, -n.y);
+			dvdp = vec3(n.y, -n.x, 0.f);
+		}
+
+		// hit records for a packet of rays, t and the normal are kept in SIMD registers
+		struct hit_record4 {
+			float4 t;
+			vec3x4 norm;
+			vec2 texc[packet_width];
+			vec3 dudp[packet_width], dvdp[packet_width];
+			hit_record4() : t(10000.f), norm(vec3(0.f)) {
+				for (int i = 0; i < packet_width; ++i) dudp[i] = dvdp[i] = vec3(0.f);
+			}
+
+			// copy the hit record h into lane i
+			inline void set_lane(int i, const hit_record& h) {
+				float4 m = lane_mask(1 << i);
+				t = select(m, float4(h.t), t);
+				norm = select(m, vec3x4(h.norm), norm);
+				texc[i] = h.texc;
+				dudp[i] = h.dudp;
+				dvdp[i] = h.dvdp;
+			}
+		};
+
 		struct surface {
 			virtual bool hit(const ray& r, hit_record* hr) const = 0;
+			// check if the surface is hit along r before tmax, without working out where or how
+			virtual bool occluded(const ray& r, float tmax) const = 0;
+
+			// packet version of hit, only the lanes in mask are tested
+			// returns the lanes whose hit record was updated, by default each lane is sent through hit() on its own
+			virtual int hit4(const ray4& r, int mask, hit_record4& hr) const {
+				int hits = 0;
+				for (int i = 0; i < packet_width; ++i) {
+					if (!(mask & (1 << i))) continue;
+					hit_record h; h.t = hr.t[i];
+					if (hit(r[i], &h)) {
+						hr.set_lane(i, h);
+						hits |= 1 << i;
+					}
+				}
+				return hits;
+			}
+			// packet version of occluded, returns the lanes in mask that hit the surface before tmax
+			virtual int occluded4(const ray4& r, int mask, float4 tmax) const {
+				int occ = 0;
+				for (int i = 0; i < packet_width; ++i)
+					if ((mask & (1 << i)) && occluded(r[i], tmax[i])) occ |= 1 << i;
+				return occ;
+			}
+
+			// bounds of the surface in its local space for any time in [t0, t1], aabb::infinite() if it can't be bounded
+			virtual aabb bounds(float t0, float t1) const = 0;
+			// called before rays with times in [t0, t1] are traced, so acceleration structures can be updated
+			virtual void prepare(float, float) {}
+			// true if the surface changes over time
+			virtual bool dynamic() const { return false; }
 		};
 
 		struct group : public surface {
@@ -20,6 +83,7 @@ namespace whrt5 {
 			group(initializer_list<shared_ptr<surface>> s) : surfaces(s.begin(), s.end()) {}
 
 			bool hit(const ray& r, hit_record* hr) const override {
+				if (hr == nullptr) return occluded(r, FLT_MAX);
 				hit_record low; bool hit = false;
 				for (const auto s : surfaces) {
 					hit_record thr;
@@ -28,9 +92,81 @@ namespace whrt5 {
 						hit = true;
 					}
 				}
-				if (hr != nullptr && low.t < hr->t) *hr = low;
+				if (low.t < hr->t) *hr = low;
 				return hit;
 			}
+
+			bool occluded(const ray& r, float tmax) const override {
+				for (const auto& s : surfaces)
+					if (s->occluded(r, tmax)) return true;
+				return false;
+			}
+
+			int hit4(const ray4& r, int mask, hit_record4& hr) const override {
+				int hits = 0;
+				for (const auto& s : surfaces)
+					hits |= s->hit4(r, mask, hr);
+				return hits;
+			}
+
+			int occluded4(const ray4& r, int mask, float4 tmax) const override {
+				int occ = 0;
+				for (const auto& s : surfaces) {
+					occ |= s->occluded4(r, mask & ~occ, tmax);
+					if (occ == mask) break;
+				}
+				return occ;
+			}
+
+			aabb bounds(float t0, float t1) const override {
+				if (surfaces.empty()) return aabb();
+				aabb b = surfaces[0]->bounds(t0, t1);
+				for (const auto& s : surfaces) b = aabb(b, s->bounds(t0, t1));
+				return b;
+			}
+
+			void prepare(float t0, float t1) override {
+				for (const auto& s : surfaces) s->prepare(t0, t1);
+			}
+
+			bool dynamic() const override {
+				return any_of(surfaces.begin(), surfaces.end(), [](const shared_ptr<surface>& s) { return s->dynamic(); });
+			}
+		};
+
+		// a group of surfaces that is tested against a ray through a BVH instead of one by one
+		struct bvh_group : public surface {
+			bvh<surface, hit_record> tree;
+			bvh_group(const vector<shared_ptr<surface>>& s) : tree(s) {}
+			bvh_group(initializer_list<shared_ptr<surface>> s) : tree(vector<shared_ptr<surface>>(s.begin(), s.end())) {}
+
+			bool hit(const ray& r, hit_record* hr) const override {
+				return tree.hit(r, hr);
+			}
+
+			bool occluded(const ray& r, float tmax) const override {
+				return tree.occluded(r, tmax);
+			}
+
+			int hit4(const ray4& r, int mask, hit_record4& hr) const override {
+				return tree.hit4(r, mask, hr);
+			}
+
+			int occluded4(const ray4& r, int mask, float4 tmax) const override {
+				return tree.occluded4(r, mask, tmax);
+			}
+
+			aabb bounds(float, float) const override {
+				return tree.bounds();
+			}
+
+			void prepare(float t0, float t1) override {
+				tree.update(t0, t1);
+			}
+
+			bool dynamic() const override {
+				return tree.dynamic();
+			}
 		};
 
 		struct sphere : public surface {
@@ -38,9 +174,40 @@ namespace whrt5 {
 
 			sphere(animated<vec3> c, float r) : center(c), radius(r) {}
 
-			/*inline aabb bounds() const override {
-			return aabb(center - radius, center + radius);
-			}*/
+			aabb bounds(float t0, float t1) const override {
+				return center.bounds(aabb(vec3(-radius), vec3(radius)), t0, t1);
+			}
+
+			bool dynamic() const override {
+				return !center.const_val;
+			}
+
+			// texture coordinates of the point on the sphere with normal n
+			static inline vec2 texcoord(vec3 n) {
+				float cos_phi = -dot(n, vec3(0, 1, 0));
+				float phi = acosf(cos_phi);
+				float sin_phi = sin(phi);
+				float theta = acosf(dot(vec3(0, 0, -1), n) / sin_phi) * two_over_pi<float>();
+				if (dot(vec3(1, 0, 0), n) >= 0) theta = 1.f - theta;
+				return vec2(theta, phi * one_over_pi<float>());
+			}
+
+			// texture gradients of texcoord() at the point with normal n on a sphere of radius r
+			// u goes around the y axis and v from pole to pole, so the two are perpendicular
+			static inline void texgrad(vec3 n, float r, vec3& dudp, vec3& dvdp) {
+				float sin_phi = glm::max(sqrt(glm::max(0.f, 1.f - n.y*n.y)), 1e-3f);
+				dudp = vec3(n.z, 0.f, -n.x) * (two_over_pi<float>() / (r*sin_phi*sin_phi));
+				dvdp = vec3(-n.y*n.x / sin_phi, sin_phi, -n.y*n.z / sin_phi) * (one_over_pi<float>() / r);
+			}
+
+			// center of the sphere for each active lane of a packet
+			inline vec3x4 centers(const ray4& r, int mask) const {
+				if (center.const_val) return vec3x4(center.cv);
+				vec3 c[packet_width];
+				for (int i = 0; i < packet_width; ++i)
+					c[i] = (mask & (1 << i)) ? center(r.time[i]) : vec3(0.f);
+				return vec3x4(c);
+			}
 
 			bool hit(const ray& r, hit_record* hr) const override {
 				vec3 centr = center(r.time);
@@ -55,22 +222,51 @@ namespace whrt5 {
 					if (hr->t < i1) return false;
 					hr->t = i1;
 					hr->norm = normalize(r(i1) - centr);
-					float cos_phi = -dot(hr->norm, vec3(0, 1, 0));
-					float phi = acosf(cos_phi);
-					float sin_phi = sin(phi);
-					hr->texc.y = phi * one_over_pi<float>();
-					float theta = acosf(dot(vec3(0, 0, -1), hr->norm) / sin_phi) * two_over_pi<float>();
-					if (dot(vec3(1, 0, 0), hr->norm) >= 0) theta = 1.f - theta;
-					hr->texc.x = theta;
-					/*				auto p = r(i1);
-					hr->dpdu = vec3(-2.f*pi<float>()*p.y, 2.f*pi<float>()*p.x, 0);
-					hr->dpdv = vec3(p.z*cos_phi, p.z*sin_phi, -radius*sin(theta));
-
-					hr->surf = this;*/
+					hr->texc = texcoord(hr->norm);
+					texgrad(hr->norm, radius, hr->dudp, hr->dvdp);
 					return true;
 				}
 				return false;
 			}
+
+			bool occluded(const ray& r, float tmax) const override {
+				vec3 v = r.e - center(r.time);
+				float b = -dot(v, r.d);
+				float det = (b*b) - dot(v, v) + radius*radius;
+				if (det < 0) return false;
+				det = sqrt(det);
+				float i1 = b - det, i2 = b + det;
+				return i1 > 0 && i2 > 0 && i1 < tmax;
+			}
+
+			int hit4(const ray4& r, int mask, hit_record4& hr) const override {
+				vec3x4 c = centers(r, mask);
+				vec3x4 v = r.e - c;
+				float4 b = -dot(v, r.d);
+				float4 det = b*b - dot(v, v) + float4(radius*radius);
+				float4 sq = vsqrt(vmax(det, float4(0.f)));
+				float4 i1 = b - sq, i2 = b + sq, zero = float4(0.f);
+				int hits = movemask((det >= zero) & (i1 > zero) & (i2 > zero) & (i1 <= hr.t)) & mask;
+				if (hits == 0) return 0;
+				float4 m = lane_mask(hits);
+				hr.t = select(m, i1, hr.t);
+				hr.norm = select(m, normalize(r(i1) - c), hr.norm);
+				for (int i = 0; i < packet_width; ++i)
+					if (hits & (1 << i)) {
+						hr.texc[i] = texcoord(hr.norm[i]);
+						texgrad(hr.norm[i], radius, hr.dudp[i], hr.dvdp[i]);
+					}
+				return hits;
+			}
+
+			int occluded4(const ray4& r, int mask, float4 tmax) const override {
+				vec3x4 v = r.e - centers(r, mask);
+				float4 b = -dot(v, r.d);
+				float4 det = b*b - dot(v, v) + float4(radius*radius);
+				float4 sq = vsqrt(vmax(det, float4(0.f)));
+				float4 i1 = b - sq, i2 = b + sq, zero = float4(0.f);
+				return movemask((det >= zero) & (i1 > zero) & (i2 > zero) & (i1 < tmax)) & mask;
+			}
 		};
 
 		struct cylinder : public surface {
@@ -78,7 +274,17 @@ namespace whrt5 {
 			float height;
 
 			cylinder(float r, float h) : radius(r), height(h) {}
+
+			aabb bounds(float, float) const override {
+				return aabb(vec3(-radius, 0.f, -radius), vec3(radius, height, radius));
+			}
 			
+			// texture gradients of texc = (atan(p.z/p.x), p.y) at p
+			static inline void texgrad(vec3 p, vec3& dudp, vec3& dvdp) {
+				dudp = vec3(-p.z, 0.f, p.x) / glm::max(p.x*p.x + p.z*p.z, 1e-12f);
+				dvdp = vec3(0.f, 1.f, 0.f);
+			}
+
 			bool hit(const ray& r, hit_record* hr) const override {
 				// (ox+dx*t)^2 + (oz+dz*t)^2 = radius^2; 0 < y < height
 				float I1 = 2.f * dot(r.e.xz(), r.d.xz());
@@ -90,22 +296,81 @@ namespace whrt5 {
 				float t2 = (-det - 2.f*r.e.x*r.d.x - 2.f*r.e.z*r.d.z)/denm;
 				float y1 = r.e.y + r.d.y*t1;
 				float y2 = r.e.y + r.d.y*t2;
-				if (y1 < 0 || y1 > height) t1 = 1e9f;
-				if (y2 < 0 || y2 > height) t2 = 1e9f;
-				float t = glm::min(t1, t2);
+				// the nearest root in front of the ray and within the height, the same roots occluded accepts
+				bool ok1 = t1 > 0.f && y1 >= 0.f && y1 <= height;
+				bool ok2 = t2 > 0.f && y2 >= 0.f && y2 <= height;
+				if (!ok1 && !ok2) return false;
+				float t = ok1 && ok2 ? glm::min(t1, t2) : (ok1 ? t1 : t2);
 				vec3 p = r(t);
-				if (t < 0.f || p.y < 0.f || p.y > height) return false;
 				if (hr != nullptr) {
 					if (hr->t < t) return false;
 					hr->t = t;
 					hr->norm = normalize(vec3(p.x, 0.01f, p.z));
 					hr->texc = vec2(atan(p.z/p.x), p.y);
+					texgrad(p, hr->dudp, hr->dvdp);
 					return true;
 				}
 				else {
 					return true;
 				}
 			}
+
+			bool occluded(const ray& r, float tmax) const override {
+				float I1 = 2.f * dot(r.e.xz(), r.d.xz());
+				float denm = 2.f * dot(r.d.xz(), r.d.xz());
+				float det = I1*I1 - 2.f*denm*(dot(r.e.xz(), r.e.xz()) - radius*radius);
+				if (det < 0.f) return false;
+				det = sqrt(det);
+				float t1 = (det - I1) / denm;
+				float t2 = (-det - I1) / denm;
+				float y1 = r.e.y + r.d.y*t1;
+				float y2 = r.e.y + r.d.y*t2;
+				return (t1 > 0.f && t1 < tmax && y1 >= 0.f && y1 <= height) ||
+					(t2 > 0.f && t2 < tmax && y2 >= 0.f && y2 <= height);
+			}
+
+			// both roots of the intersection with the infinite cylinder for a packet, and a mask of lanes that have them
+			inline float4 roots4(const ray4& r, float4& t1, float4& t2) const {
+				float4 I1 = float4(2.f) * (r.e.x*r.d.x + r.e.z*r.d.z);
+				float4 denm = float4(2.f) * (r.d.x*r.d.x + r.d.z*r.d.z);
+				float4 det = I1*I1 - float4(2.f)*denm*(r.e.x*r.e.x + r.e.z*r.e.z - float4(radius*radius));
+				float4 sq = vsqrt(vmax(det, float4(0.f)));
+				t1 = (sq - I1) / denm;
+				t2 = (-sq - I1) / denm;
+				return det >= float4(0.f);
+			}
+
+			int hit4(const ray4& r, int mask, hit_record4& hr) const override {
+				float4 t1, t2;
+				float4 valid = roots4(r, t1, t2);
+				float4 zero = float4(0.f), h = float4(height), never = float4(FLT_MAX);
+				float4 y1 = r.e.y + r.d.y*t1, y2 = r.e.y + r.d.y*t2;
+				float4 ok1 = (t1 > zero) & (y1 >= zero) & (y1 <= h);
+				float4 ok2 = (t2 > zero) & (y2 >= zero) & (y2 <= h);
+				float4 t = vmin(select(ok1, t1, never), select(ok2, t2, never));
+				vec3x4 p = r(t);
+				int hits = movemask(valid & (ok1 | ok2) & (t <= hr.t)) & mask;
+				if (hits == 0) return 0;
+				float4 m = lane_mask(hits);
+				hr.t = select(m, t, hr.t);
+				hr.norm = select(m, normalize(vec3x4(p.x, float4(0.01f), p.z)), hr.norm);
+				for (int i = 0; i < packet_width; ++i)
+					if (hits & (1 << i)) {
+						hr.texc[i] = vec2(atan(p.z[i] / p.x[i]), p.y[i]);
+						texgrad(p[i], hr.dudp[i], hr.dvdp[i]);
+					}
+				return hits;
+			}
+
+			int occluded4(const ray4& r, int mask, float4 tmax) const override {
+				float4 t1, t2;
+				float4 valid = roots4(r, t1, t2);
+				float4 zero = float4(0.f), h = float4(height);
+				float4 y1 = r.e.y + r.d.y*t1, y2 = r.e.y + r.d.y*t2;
+				float4 h1 = (t1 > zero) & (t1 < tmax) & (y1 >= zero) & (y1 <= h);
+				float4 h2 = (t2 > zero) & (t2 < tmax) & (y2 >= zero) & (y2 <= h);
+				return movemask(valid & (h1 | h2)) & mask;
+			}
 		};
 
 		struct disk : public surface {
@@ -116,21 +381,67 @@ namespace whrt5 {
 			disk(vec3 center, float r, vec3 nm = vec3(0.f, 1.f, 0.f))
 				: center(center), radius(r), norm(nm) {}
 
+			aabb bounds(float, float) const override {
+				// extent of the disk along each axis is radius*sin(angle between axis and normal)
+				vec3 e = radius * sqrt(glm::max(vec3(0.f), 1.f - norm*norm));
+				return aabb(center - e, center + e);
+			}
+
 			bool hit(const ray& r, hit_record* hr) const override {
 				float D = dot(norm, r.d);
 				if (abs(D) > 0.000001f) {
 					if (hr == nullptr) return true;
 					float t = dot(center - r.e, norm) / D;
-					if (t > hr->t) return false;
+					if (t <= 0.f || t > hr->t) return false;
 					vec3 p = r(t);
-					if (dot(p, p) > radius*radius) return false;
+					if (dot(p - center, p - center) > radius*radius) return false;
 					hr->t = t;
 					hr->norm = norm;
 					hr->texc = cross(p, norm).xz;
+					planar_texgrad(norm, hr->dudp, hr->dvdp);
 					return true;
 				}
 				return false;
 			}
+
+			bool occluded(const ray& r, float tmax) const override {
+				float D = dot(norm, r.d);
+				if (abs(D) <= 0.000001f) return false;
+				float t = dot(center - r.e, norm) / D;
+				if (t <= 0.f || t >= tmax) return false;
+				vec3 p = r(t) - center;
+				return dot(p, p) <= radius*radius;
+			}
+
+			// distance along each ray of a packet to the plane of the disk, and a mask of lanes that land inside the disk
+			inline float4 plane4(const ray4& r, float4& t) const {
+				vec3x4 n = vec3x4(norm), c = vec3x4(center);
+				float4 D = dot(n, r.d);
+				t = dot(c - r.e, n) / D;
+				vec3x4 p = r(t) - c;
+				return (vabs(D) > float4(0.000001f)) & (t > float4(0.f)) & (dot(p, p) <= float4(radius*radius));
+			}
+
+			int hit4(const ray4& r, int mask, hit_record4& hr) const override {
+				float4 t;
+				int hits = movemask(plane4(r, t) & (t <= hr.t)) & mask;
+				if (hits == 0) return 0;
+				float4 m = lane_mask(hits);
+				hr.t = select(m, t, hr.t);
+				hr.norm = select(m, vec3x4(norm), hr.norm);
+				vec3x4 p = r(t);
+				for (int i = 0; i < packet_width; ++i)
+					if (hits & (1 << i)) {
+						hr.texc[i] = cross(p[i], norm).xz;
+						planar_texgrad(norm, hr.dudp[i], hr.dvdp[i]);
+					}
+				return hits;
+			}
+
+			int occluded4(const ray4& r, int mask, float4 tmax) const override {
+				float4 t;
+				return movemask(plane4(r, t) & (t < tmax)) & mask;
+			}
 		};
 
 		struct box : public surface {
@@ -139,6 +450,10 @@ namespace whrt5 {
 			box(vec3 center, vec3 extent)
 				: _min(center - extent), _max(center + extent) {}
 
+			aabb bounds(float, float) const override {
+				return aabb(_min, _max);
+			}
+
 			bool hit(const ray& r, hit_record* hr) const override {
 				vec3 rrd = 1.f / r.d;
 
@@ -160,7 +475,12 @@ namespace whrt5 {
 				if (hr == nullptr) return tmax >= tmin;
 				if (hr->t < tmin) return false;
 				hr->t = tmin;
+				attributes(r(tmin), hr);
+				return true;
+			}
 
+			// normal and texture coordinates at the point p on the box
+			inline void attributes(vec3 p, hit_record* hr) const {
 				vec3 center = (_max + _min) * 0.5f;
 				vec3 extents = _max - center;
 				static const vec3 axises[] =
@@ -172,7 +492,7 @@ namespace whrt5 {
 				vec3 n = vec3(0);
 				float m = FLT_MAX;
 				float dist;
-				vec3 np = r(tmin) - center;
+				vec3 np = p - center;
 				for (int i = 0; i < 3; ++i)
 				{
 					dist = fabsf(extents[i] - fabsf(np[i]));
@@ -184,7 +504,49 @@ namespace whrt5 {
 				}
 				hr->norm = n;
 				hr->texc = cross(np, n).xz;
-				return true;
+				planar_texgrad(n, hr->dudp, hr->dvdp);
+			}
+
+			bool occluded(const ray& r, float tmax) const override {
+				vec3 rrd = 1.f / r.d;
+				vec3 t1 = (_min - r.e) * rrd;
+				vec3 t2 = (_max - r.e) * rrd;
+				vec3 m12 = glm::min(t1, t2);
+				vec3 x12 = glm::max(t1, t2);
+				float bmin = glm::max(m12.x, glm::max(m12.y, m12.z));
+				float bmax = glm::min(x12.x, glm::min(x12.y, x12.z));
+				return bmax >= bmin && bmin >= 0 && bmin < tmax;
+			}
+
+			// entry and exit distances of a packet through the box
+			inline void slabs4(const ray4& r, float4& tmin, float4& tmax) const {
+				float4 one = float4(1.f);
+				float4 t1x = (float4(_min.x) - r.e.x) * (one / r.d.x), t2x = (float4(_max.x) - r.e.x) * (one / r.d.x);
+				float4 t1y = (float4(_min.y) - r.e.y) * (one / r.d.y), t2y = (float4(_max.y) - r.e.y) * (one / r.d.y);
+				float4 t1z = (float4(_min.z) - r.e.z) * (one / r.d.z), t2z = (float4(_max.z) - r.e.z) * (one / r.d.z);
+				tmin = vmax(vmax(vmin(t1x, t2x), vmin(t1y, t2y)), vmin(t1z, t2z));
+				tmax = vmin(vmin(vmax(t1x, t2x), vmax(t1y, t2y)), vmax(t1z, t2z));
+			}
+
+			int hit4(const ray4& r, int mask, hit_record4& hr) const override {
+				float4 tmin, tmax;
+				slabs4(r, tmin, tmax);
+				int hits = movemask((tmax >= tmin) & (tmin >= float4(0.f)) & (tmin <= hr.t)) & mask;
+				if (hits == 0) return 0;
+				vec3x4 p = r(tmin);
+				for (int i = 0; i < packet_width; ++i) {
+					if (!(hits & (1 << i))) continue;
+					hit_record h; h.t = tmin[i];
+					attributes(p[i], &h);
+					hr.set_lane(i, h);
+				}
+				return hits;
+			}
+
+			int occluded4(const ray4& r, int mask, float4 tmax) const override {
+				float4 bmin, bmax;
+				slabs4(r, bmin, bmax);
+				return movemask((bmax >= bmin) & (bmin >= float4(0.f)) & (bmin < tmax)) & mask;
 			}
 		};
 	}
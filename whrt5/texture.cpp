@@ -1,68 +1,125 @@
 #include "texture.h"
+#include "thread_pool.h"
+#include "image_io.h"
 
 #define _MSVC_
 namespace whrt5 {
-	texture2d::texture2d(const string& bmp_filename)
-	{
-		/*
-			I stole this code from somewhere, I don't remember where
-			It's not the greatest but it works, so for now it can be kept
-			In the future it may be aventagous to use the rest of stb_image to do this
-		*/
-		unsigned char header[54];
-		unsigned int dataPos;
-		unsigned int imageSize;
-		unsigned int width, height;
-
-		unsigned char * data;
-
-		FILE * file;
-#ifdef _MSVC_
-		fopen_s(&file, bmp_filename.c_str(), "rb");
-#else
-		file = fopen(bmp_filename.c_str(), "rb");
-#endif
-		if (!file) throw runtime_error((string("couldn't open file ") + bmp_filename));
-		if (fread(header, 1, 54, file) != 54)
-			throw runtime_error("invalid BMP header");
-
-		//// A BMP files always begins with "BM"
-
-		if (header[0] != 'B' || header[1] != 'M')
-			throw runtime_error("invalid BMP file");
-
-		//// Make sure this is a 24bpp file
+	void texture2d::allocate(texture_layout l) {
+		_layout = l;
+		size_t n;
+		switch (l) {
+		case texture_layout::tiled:
+			_tiles_x = (size.x + 7) / 8;
+			n = (size_t)_tiles_x*((size.y + 7) / 8) * 64;
+			break;
+		case texture_layout::morton:
+			_tiles_x = (size.x + 31) / 32;
+			n = (size_t)_tiles_x*((size.y + 31) / 32) * 1024;
+			break;
+		default:
+			_tiles_x = 0;
+			n = (size_t)size.x*size.y;
+			break;
+		}
+		_pixels.assign(n, vec3(0.f));
+	}
 
-		if (*(int*)&(header[0x1E]) != 0)          throw runtime_error("Not a correct BMP file\n");
-		if (*(int*)&(header[0x1C]) != 24)         throw runtime_error("Not a correct BMP file\n");
+	void texture2d::set_layout(texture_layout l) {
+		for (auto& m : mips) m->set_layout(l);
+		if (l == _layout) return;
+		texture2d t(size, l);
+		for (uint32 y = 0; y < size.y; ++y)
+			for (uint32 x = 0; x < size.x; ++x)
+				t.pixel(uvec2(x, y)) = pixel(uvec2(x, y));
+		_pixels = move(t._pixels);
+		_layout = l;
+		_tiles_x = t._tiles_x;
+	}
 
-		dataPos = *(int*)&(header[0x0A]);
-		imageSize = *(int*)&(header[0x22]);
-		width = *(int*)&(header[0x12]);
-		height = *(int*)&(header[0x16]);
-		size = uvec2(width, height);
+	const vec3* texture2d::row(uint32 y, vec3* scratch) const {
+		switch (_layout) {
+		case texture_layout::linear:
+			return &_pixels[(size_t)y*size.x];
+		case texture_layout::tiled:
+			// whole runs of 8 are contiguous
+			for (uint32 x = 0; x < size.x; x += 8)
+				memcpy(scratch + x, &pixel(uvec2(x, y)), sizeof(vec3)*glm::min(8u, size.x - x));
+			break;
+		default:
+			for (uint32 x = 0; x < size.x; ++x)
+				scratch[x] = pixel(uvec2(x, y));
+			break;
+		}
+		return scratch;
+	}
 
+	texture2d::texture2d(const string& filename, texture_layout l)
+		: texture2d(load_image(filename, l))
+	{
+		generate_mips();
+	}
 
-		if (imageSize == 0)    imageSize = width*height * 3;
-		if (dataPos == 0)      dataPos = 54;
+	vec3 texture2d::bilinear(vec2 c) const {
+		return bilinear_filter(size, c, [this](uvec2 p) { return pixel(p); });
+	}
 
-		data = new unsigned char[imageSize];
-		fread(data, 1, imageSize, file);
-		fclose(file);
+	void texture2d::generate_mips() {
+		mips.clear();
+		const texture2d* src = this;
+		while (src->size.x > 1 || src->size.y > 1) {
+			uvec2 ns = glm::max(src->size / 2u, uvec2(1));
+			auto m = make_shared<texture2d>(ns, _layout);
+			for (uint32 y = 0; y < ns.y; ++y) {
+				for (uint32 x = 0; x < ns.x; ++x) {
+					// odd sizes fold their last row or column into the pixel before it
+					uvec2 a = uvec2(x, y)*2u, b = glm::min(a + 1u, src->size - 1u);
+					m->pixel(uvec2(x, y)) = (src->pixel(a) + src->pixel(uvec2(b.x, a.y))
+						+ src->pixel(uvec2(a.x, b.y)) + src->pixel(b))*.25f;
+				}
+			}
+			mips.push_back(m);
+			src = m.get();
+		}
+	}
 
-		_pixels = vector<vec3>(imageSize / 3);
+	vec3 texture2d::texel(vec2 c, vec2 dx, vec2 dy) const {
+		if (mips.empty()) return texel(c);
+		return trilinear_filter(size, mips.size(), c, dx, dy, [this](size_t l, vec2 c) {
+			return l == 0 ? bilinear(c) : mips[l - 1]->bilinear(c);
+		});
+	}
 
-		int j = 0;
-		for (int i = imageSize; i > 0; i -= 3)
-		{
-			vec3 d(0);
-			d.b = (float)(data[i]) / 255.f;
-			d.g = (float)(data[i + 1]) / 255.f;
-			d.r = (float)(data[i + 2]) / 255.f;
-			_pixels[j] = d;
-			j++;
+	void texture2d::texel_batch(const vec2* c, vec3* out, size_t n) const {
+		float4 w((float)size.x), h((float)size.y), xmax((float)size.x - 1.f), ymax((float)size.y - 1.f);
+		size_t i = 0;
+		for (; i + 4 <= n; i += 4) {
+			float4 u, v;
+			load_vec2x4(c + i, u, v);
+			// repeat, scale to pixels and clamp the same way as texel
+			u = vmin(vfloor((u - vfloor(u))*w), xmax);
+			v = vmin(vfloor((v - vfloor(v))*h), ymax);
+			alignas(16) int32_t x[4], y[4];
+			_mm_store_si128((__m128i*)x, _mm_cvttps_epi32(u.v));
+			_mm_store_si128((__m128i*)y, _mm_cvttps_epi32(v.v));
+			for (int k = 0; k < 4; ++k)
+				out[i + k] = pixel(uvec2(x[k], y[k]));
 		}
+		for (; i < n; ++i) out[i] = texel(c[i]);
+	}
 
+	shared_ptr<texture2d> bake_texture(const texture<vec3, vec2>& tx, uvec2 size, texture_layout l) {
+		auto b = make_shared<texture2d>(size, l);
+		thread_pool::global().parallel_for(size.y, [&](uint32 y) {
+			vector<vec2> c(size.x);
+			vector<vec3> row(size.x);
+			for (uint32 x = 0; x < size.x; ++x)
+				c[x] = (vec2(x, y) + .5f) / (vec2)size;
+			tx.texel_batch(c.data(), row.data(), size.x);
+			for (uint32 x = 0; x < size.x; ++x)
+				b->pixel(uvec2(x, y)) = row[x];
+		});
+		b->generate_mips();
+		return b;
 	}
 
 	//fantastic STB libary portion
@@ -183,7 +240,7 @@ namespace whrt5 {
 		{
 			for (int x = 0; x < size.x * 4; x += 4)
 			{
-				vec3 d = clamp(_pixels[(y*size.x + x) / 4], vec3(0), vec3(1));
+				vec3 d = clamp(pixel(uvec2(x / 4, y / 4)), vec3(0), vec3(1));
 				imgdata[(y*size.x + x)] = (unsigned char)(d.x * 255.f);
 				imgdata[(y*size.x + x) + 1] = (unsigned char)(d.y * 255.f);
 				imgdata[(y*size.x + x) + 2] = (unsigned char)(d.z * 255.f);
@@ -616,7 +673,7 @@ namespace whrt5 {
 				if (c == 'x')
 				{
 					auto c = cpos + texpos;
-					_pixels[c.x + c.y*size.x] = color;
+					pixel(c) = color;
 				}
 				cpos.x++;
 				if (cpos.x >= char_width)
@@ -632,32 +689,14 @@ namespace whrt5 {
 
 	}
 
-	void texture2d::tiled_multithreaded_raster(uvec2 tilesize, function<vec3(uvec2)> f) {
-		queue<uvec2> tiles;
-		for (uint32 y = 0; y < size.y; y += tilesize.y) {
-			for (uint32 x = 0; x < size.x; x += tilesize.x) {
-				tiles.push(uvec2(x, y));
-			}
-		}
-		mutex tile_qu_mutex;
-		vector<thread> workers;
-		for (int P = 0; P < thread::hardware_concurrency(); ++P) {
-			workers.push_back(thread([&]() {
-				while (true) {
-					uvec2 tile;
-					{
-						unique_lock<mutex> lm(tile_qu_mutex);
-						if (tiles.empty()) break;
-						tile = tiles.front(); tiles.pop();
-					}
-					for (uint32 y = tile.y; y < tile.y+tilesize.y && y < size.y; ++y)
-						for (uint32 x = tile.x; x < tile.x+tilesize.x && x < size.x; ++x)
-							pixel(uvec2(x, y)) = f(uvec2(x, y));
-					cout << "~";
-				}
-			}));
-		}
-		
-		for (auto& t : workers) t.join();
+	void texture2d::tiled_multithreaded_raster(uvec2 tilesize, function<vec3(uvec2)> f,
+		function<void(uint32, uint32)> progress) {
+		uvec2 tiles = (size + tilesize - 1u) / tilesize;
+		thread_pool::global().parallel_for(tiles.x*tiles.y, [&](uint32 ti) {
+			uvec2 tile = uvec2(ti % tiles.x, ti / tiles.x)*tilesize;
+			for (uint32 y = tile.y; y < tile.y+tilesize.y && y < size.y; ++y)
+				for (uint32 x = tile.x; x < tile.x+tilesize.x && x < size.x; ++x)
+					pixel(uvec2(x, y)) = f(uvec2(x, y));
+		}, progress);
 	}
 }
\ No newline at end of file
@@ -1,5 +1,6 @@
 #pragma once
 #include "cmmn.h"
+#include "packet.h"
 
 namespace whrt5 {
 
@@ -14,11 +15,58 @@ namespace whrt5 {
 	public:
 		// maps Tx -> C
 		virtual C texel(Tx c) const = 0;
+		// maps Tx -> C averaged over the footprint of a pixel, dx and dy are how far c moves to the next pixel in x and y
+		// textures that don't filter just return texel(c)
+		virtual C texel(Tx c, Tx, Tx) const { return texel(c); }
+		// true if texel(c, dx, dy) uses the footprint, so that callers can skip working it out
+		virtual bool filtered() const { return false; }
+		// texel(c[i]) into out[i] for n coordinates at once, textures that can do several lookups at once with SIMD
+		// override this so that shading grouped by material can run wide
+		virtual void texel_batch(const Tx* c, C* out, size_t n) const {
+			for (size_t i = 0; i < n; ++i) out[i] = texel(c[i]);
+		}
 		virtual ~texture() {}
 	};
 
+	// bilinear lookup in a repeating image of size size, where pixel(uvec2) reads a pixel. c is in [0, 1]
+	template<typename P>
+	inline vec3 bilinear_filter(uvec2 size, vec2 c, P pixel) {
+		vec2 p = mod(c, vec2(1.f))*(vec2)size - .5f;
+		vec2 f = p - floor(p);
+		int x0 = (int)floor(p.x), y0 = (int)floor(p.y);
+		auto wrap = [](int i, uint32 n) { return (uint32)((i % (int)n + (int)n) % (int)n); };
+		uint32 xa = wrap(x0, size.x), xb = wrap(x0 + 1, size.x), ya = wrap(y0, size.y), yb = wrap(y0 + 1, size.y);
+		return mix(mix(pixel(uvec2(xa, ya)), pixel(uvec2(xb, ya)), f.x),
+			mix(pixel(uvec2(xa, yb)), pixel(uvec2(xb, yb)), f.x), f.y);
+	}
+
+	// trilinear lookup in an image of size size with level_count mip levels below it. the level comes from the
+	// footprint dx, dy and lookup(l, c) does a bilinear lookup in level l, where 0 is the full size image
+	template<typename L>
+	inline vec3 trilinear_filter(uvec2 size, size_t level_count, vec2 c, vec2 dx, vec2 dy, L lookup) {
+		// footprint width in pixels of the full size image picks the level
+		float width = glm::max(length(dx*(vec2)size), length(dy*(vec2)size));
+		if (width <= 1.f) return lookup(0, c);
+		float level = glm::min(log2(width), (float)level_count);
+		uint32 l = (uint32)level;
+		if (l >= level_count) return lookup(l, c);
+		return mix(lookup(l, c), lookup(l + 1, c), level - (float)l);
+	}
+
+	// order of the pixels of a texture2d in memory
+	enum class texture_layout {
+		// row by row
+		linear,
+		// 8x8 tiles stored row by row, each tile row by row inside
+		tiled,
+		// 32x32 blocks stored row by row, each block in Z order inside. a 32x32 raster tile is one contiguous block
+		// and pixels close in 2D are mostly close in memory too, at any scale up to the block size
+		morton,
+	};
+
 	/*
 		a 2D texture class backed by a pixel array
+		the pixels can be stored in any texture_layout, the non-linear ones are padded out to whole tiles
 
 		!!! memory allocated (_pixels) ownership is murky when considering copying this class,
 		!!! perhaps someone should fix that
@@ -27,25 +75,60 @@ namespace whrt5 {
 	{
 	protected:
 		vector<vec3> _pixels;
+		texture_layout _layout;
+		// number of tiles or blocks across a row
+		uint32 _tiles_x;
+
+		// spread the low 5 bits of v out to the even bits
+		static inline uint32 spread_bits(uint32 v) {
+			v &= 0x1f;
+			v = (v | (v << 4)) & 0x0f0f;
+			v = (v | (v << 2)) & 0x3333;
+			return (v | (v << 1)) & 0x5555;
+		}
+
+		// size _pixels for size and layout l, the contents are lost
+		void allocate(texture_layout l);
 	public:
 		// size of texture in pixels
 		uvec2 size;
 
-		// create a new, uninitialized texture of size _s
-		texture2d(uvec2 _s) : size(_s), _pixels(_s.x*_s.y, vec3(0.f)) {}
-		// create a texture by loading data out of a BMP file
-		texture2d(const string& bmp_filename);
+		// create a new texture of size _s filled with black
+		texture2d(uvec2 _s, texture_layout l = texture_layout::linear) : size(_s) { allocate(l); }
+		// create a texture by loading an image file with load_image, and build its mips
+		texture2d(const string& filename, texture_layout l = texture_layout::linear);
+
+		texture_layout layout() const { return _layout; }
+		// reorder the pixels into layout l
+		void set_layout(texture_layout l);
+
+		// where pixel c is in _pixels
+		inline size_t index(uvec2 c) const
+		{
+			switch (_layout) {
+			case texture_layout::tiled:
+				return ((size_t)((c.y >> 3)*_tiles_x + (c.x >> 3)) << 6) | ((c.y & 7) << 3) | (c.x & 7);
+			case texture_layout::morton:
+				return ((size_t)((c.y >> 5)*_tiles_x + (c.x >> 5)) << 10) | spread_bits(c.x) | (spread_bits(c.y) << 1);
+			default:
+				return c.x + (size_t)c.y*size.x;
+			}
+		}
 
 		// gets a pixel value from the texture, must be in [0, size)
 		inline const vec3& pixel(uvec2 c) const
 		{
-			return _pixels[c.x + c.y*size.x];
+			return _pixels[index(c)];
 		}
 		inline vec3& pixel(uvec2 c)
 		{
-			return _pixels[c.x + c.y*size.x];
+			return _pixels[index(c)];
 		}
 
+		// pointer to the size.x pixels of row y, which points into the texture for linear layouts and otherwise
+		// points to scratch after the row is copied there
+		const vec3* row(uint32 y, vec3* scratch) const;
+
 		// maps texel coords to pixel coords and reads the subsequent pixel
 		// c is in [0, 1] range
 		// currently repeats the texture if it is beyond that
@@ -59,6 +142,20 @@ namespace whrt5 {
 			return pixel(ic);
 		}
 
+		// bilinear lookup, c is in [0, 1] and repeats like texel
+		vec3 bilinear(vec2 c) const;
+
+		// smaller copies of this texture, each half the size of the last down to 1x1, made by generate_mips
+		vector<shared_ptr<texture2d>> mips;
+		// box filter the mip pyramid out of the current pixels
+		void generate_mips();
+
+		// trilinear lookup in the mip level that matches the footprint, or texel(c) if there are no mips
+		vec3 texel(vec2 c, vec2 dx, vec2 dy) const override;
+		bool filtered() const override { return !mips.empty(); }
+		// the coordinates of 4 lookups at a time are worked out with SSE, the pixels are then read one by one
+		void texel_batch(const vec2* c, vec3* out, size_t n) const override;
+
 		// write this texture to a BMP file
 		// doesn't perform any gamma correction/tonemap, just dumps bits in a file
 		void write_bmp(const string& bmp_filename) const;
@@ -67,15 +164,23 @@ namespace whrt5 {
 		// not all possible characters are in the font
 		void draw_text(const string& text, uvec2 pos, vec3 color);
 
-		void tiled_multithreaded_raster(uvec2 tilesize, function<vec3(uvec2)> f);
+		// f(px) for every pixel, a tile at a time on the thread pool
+		// progress(tiles done, tiles) is called on the calling thread as the tiles finish, see thread_pool::parallel_for
+		void tiled_multithreaded_raster(uvec2 tilesize, function<vec3(uvec2)> f,
+			function<void(uint32, uint32)> progress = nullptr);
 	};
 
+	// look up tx at the centre of each pixel of a new texture of size size (with texel_batch, a row at a time on the
+	// global thread pool) and build its mips. the result costs a few pixel reads per lookup however expensive tx is
+	shared_ptr<texture2d> bake_texture(const texture<vec3, vec2>& tx, uvec2 size, texture_layout l = texture_layout::linear);
+
 	template<typename C, typename T>
 	struct const_texture : public texture<C, T> {
 		C val;
 		const_texture(C v) : val(v) {}
 
 		C texel(T) const override { return val; }
+		void texel_batch(const T*, C* out, size_t n) const override { fill(out, out + n, val); }
 	};
 
 	struct checkerboard_texture : public texture<vec3, vec2> {
@@ -90,6 +195,39 @@ namespace whrt5 {
 			uv = floor(uv*scale);
 			return colors[(size_t)mod(uv.x + uv.y, 2.f)];
 		}
+
+		// the checks are box filtered exactly over the footprint: along each axis the fraction of the box covered
+		// by odd checks is the difference of the integral of the odd-check indicator at its ends
+		vec3 texel(vec2 uv, vec2 dx, vec2 dy) const override {
+			vec2 w = glm::max(abs(dx), abs(dy))*scale;
+			if (w.x == 0.f || w.y == 0.f) return texel(uv);
+			if (w.x >= 1.f && w.y >= 1.f) return (colors[0] + colors[1])*.5f;
+			auto odd_integral = [](vec2 x) {
+				return floor(x*.5f) + 2.f*glm::max(x*.5f - floor(x*.5f) - .5f, vec2(0.f));
+			};
+			vec2 s = uv*scale;
+			vec2 odd = (odd_integral(s + w) - odd_integral(s - w)) / (2.f*w);
+			// a point is on a colors[1] check if it is odd along exactly one axis
+			float f = odd.x + odd.y - 2.f*odd.x*odd.y;
+			return mix(colors[0], colors[1], f);
+		}
+		bool filtered() const override { return true; }
+
+		void texel_batch(const vec2* uv, vec3* out, size_t n) const override {
+			float4 s(scale);
+			vec3x4 a(colors[0]), d(colors[1] - colors[0]);
+			size_t i = 0;
+			for (; i + 4 <= n; i += 4) {
+				float4 u, v;
+				load_vec2x4(uv + i, u, v);
+				float4 c = vfloor(u*s) + vfloor(v*s);
+				// 1 on odd checks, c - 2 floor(c / 2) is mod(c, 2)
+				float4 odd = c - float4(2.f)*vfloor(c*float4(.5f));
+				vec3x4 col = a + d*odd;
+				store_rgb4(out + i, col.x, col.y, col.z);
+			}
+			for (; i < n; ++i) out[i] = texel(uv[i]);
+		}
 	};
 
 	struct grid_texture : public texture<vec3, vec2> {
@@ -102,5 +240,34 @@ namespace whrt5 {
 			uv = step(fract(uv*scale), vec2(line_size));
 			return mix(bg_color, fg_color, glm::max(uv.x, uv.y));
 		}
+
+		// box filtered over the footprint: the fraction of the box covered by lines along each axis comes from the
+		// integral of the line indicator, and the two axes are combined as if they were independent
+		vec3 texel(vec2 uv, vec2 dx, vec2 dy) const override {
+			vec2 w = glm::max(abs(dx), abs(dy))*scale;
+			if (w.x == 0.f || w.y == 0.f) return texel(uv);
+			auto line_integral = [&](vec2 x) {
+				return floor(x)*line_size + glm::min(fract(x), vec2(line_size));
+			};
+			vec2 s = uv*scale;
+			vec2 cov = (line_integral(s + w) - line_integral(s - w)) / (2.f*w);
+			return mix(bg_color, fg_color, cov.x + cov.y - cov.x*cov.y);
+		}
+		bool filtered() const override { return true; }
+
+		void texel_batch(const vec2* uv, vec3* out, size_t n) const override {
+			float4 s(scale), ls(line_size);
+			vec3x4 bg(bg_color), d(fg_color - bg_color);
+			size_t i = 0;
+			for (; i + 4 <= n; i += 4) {
+				float4 u, v;
+				load_vec2x4(uv + i, u, v);
+				u = u*s; v = v*s;
+				float4 on = ((u - vfloor(u)) <= ls) | ((v - vfloor(v)) <= ls);
+				vec3x4 col = bg + d*(on & float4(1.f));
+				store_rgb4(out + i, col.x, col.y, col.z);
+			}
+			for (; i < n; ++i) out[i] = texel(uv[i]);
+		}
 	};
 }
\ No newline at end of file
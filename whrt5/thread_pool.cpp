@@ -0,0 +1,136 @@
+#include "thread_pool.h"
+
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#define NOMINMAX
+#include <Windows.h>
+#elif defined(__linux__)
+#include <pthread.h>
+#include <sched.h>
+#endif
+
+namespace whrt5 {
+	static void pin_thread(thread& t, uint32 core) {
+#ifdef _WIN32
+		SetThreadAffinityMask(t.native_handle(), (DWORD_PTR)1 << (core % (sizeof(DWORD_PTR) * 8)));
+#elif defined(__linux__)
+		cpu_set_t cs;
+		CPU_ZERO(&cs);
+		CPU_SET(core % CPU_SETSIZE, &cs);
+		pthread_setaffinity_np(t.native_handle(), sizeof(cs), &cs);
+#else
+		(void)t; (void)core;
+#endif
+	}
+
+	thread_pool::thread_pool(uint32 thread_count, bool pin)
+		: job(nullptr), generation(0), active(0), stopping(false), _completed(0), _total(0)
+	{
+		if (thread_count == 0) thread_count = 1;
+		ranges = unique_ptr<work_range[]>(new work_range[thread_count]);
+		for (uint32 i = 0; i < thread_count; ++i)
+			ranges[i].range.store(0);
+		for (uint32 i = 0; i < thread_count; ++i) {
+			threads.push_back(thread([this, i]() { work(i); }));
+			if (pin) pin_thread(threads.back(), i);
+		}
+	}
+
+	thread_pool::~thread_pool() {
+		{
+			lock_guard<mutex> lk(m);
+			stopping = true;
+		}
+		wake.notify_all();
+		for (auto& t : threads) t.join();
+	}
+
+	bool thread_pool::pop(uint32 id, uint32& i) {
+		auto& r = ranges[id].range;
+		uint64_t cur = r.load(memory_order_acquire);
+		while (true) {
+			uint32 b = (uint32)cur, e = (uint32)(cur >> 32);
+			if (b >= e) return false;
+			if (r.compare_exchange_weak(cur, pack(b + 1, e), memory_order_acq_rel)) {
+				i = b;
+				return true;
+			}
+		}
+	}
+
+	bool thread_pool::steal(uint32 id, uint32& i) {
+		uint32 n = size();
+		for (uint32 k = 1; k < n; ++k) {
+			auto& r = ranges[(id + k) % n].range;
+			uint64_t cur = r.load(memory_order_acquire);
+			while (true) {
+				uint32 b = (uint32)cur, e = (uint32)(cur >> 32);
+				if (b >= e) break;
+				uint32 mid = e - (e - b + 1) / 2;
+				if (r.compare_exchange_weak(cur, pack(b, mid), memory_order_acq_rel)) {
+					// our own range is empty, so nobody else can be changing it right now
+					ranges[id].range.store(pack(mid + 1, e), memory_order_release);
+					i = mid;
+					return true;
+				}
+			}
+		}
+		return false;
+	}
+
+	void thread_pool::work(uint32 id) {
+		uint64_t seen = 0;
+		while (true) {
+			{
+				unique_lock<mutex> lk(m);
+				wake.wait(lk, [&]() { return stopping || generation != seen; });
+				if (stopping) return;
+				seen = generation;
+			}
+			uint32 i;
+			while (pop(id, i) || steal(id, i)) {
+				(*job)(i);
+				_completed.fetch_add(1, memory_order_relaxed);
+			}
+			{
+				lock_guard<mutex> lk(m);
+				if (--active == 0) finished.notify_all();
+			}
+		}
+	}
+
+	void thread_pool::parallel_for(uint32 n, const function<void(uint32)>& f,
+		const function<void(uint32, uint32)>& progress, chrono::milliseconds interval) {
+		if (n == 0) return;
+		lock_guard<mutex> dl(dispatch);
+		uint32 tc = size();
+		_completed.store(0, memory_order_relaxed);
+		_total.store(n, memory_order_relaxed);
+		for (uint32 i = 0; i < tc; ++i)
+			ranges[i].range.store(pack((uint32)((uint64_t)n*i / tc), (uint32)((uint64_t)n*(i + 1) / tc)), memory_order_relaxed);
+		{
+			unique_lock<mutex> lk(m);
+			job = &f;
+			active = tc;
+			generation++;
+			wake.notify_all();
+			auto done = [&]() { return active == 0; };
+			if (progress) {
+				// the lock is let go while reporting so that workers running out of work never wait for it
+				while (!finished.wait_for(lk, interval, done)) {
+					lk.unlock();
+					progress(completed(), n);
+					lk.lock();
+				}
+			}
+			else finished.wait(lk, done);
+			job = nullptr;
+		}
+		if (progress) progress(n, n);
+	}
+
+	thread_pool& thread_pool::global() {
+		static thread_pool pool;
+		return pool;
+	}
+}
@@ -0,0 +1,66 @@
+#pragma once
+#include "cmmn.h"
+#include <atomic>
+#include <condition_variable>
+
+namespace whrt5 {
+	/*
+		a pool of worker threads that lives for the whole program, so rendering a frame doesn't start any threads
+
+		parallel_for splits its range evenly between the workers. each worker takes indices off the front of its own
+		range, and once that is empty it steals the back half of another worker's range. the ranges are a pair of
+		32-bit indices in one atomic so taking and stealing work is a single compare-exchange, with no lock shared
+		between the workers
+		progress can be read at any time from completed()/total() without touching the workers, and parallel_for can
+		report it from the calling thread, which would otherwise just be waiting
+	*/
+	class thread_pool {
+		// a worker's remaining range of indices [begin, end) packed as begin | end << 32
+		// padded to its own cache line so that workers taking indices don't slow each other down
+		struct work_range {
+			atomic<uint64_t> range;
+			char pad[64 - sizeof(atomic<uint64_t>)];
+		};
+
+		vector<thread> threads;
+		unique_ptr<work_range[]> ranges;
+
+		mutex m;
+		condition_variable wake, finished;
+		const function<void(uint32)>* job;
+		uint64_t generation;
+		uint32 active;
+		bool stopping;
+
+		// one parallel_for at a time
+		mutex dispatch;
+		atomic<uint32> _completed, _total;
+
+		static inline uint64_t pack(uint32 b, uint32 e) { return (uint64_t)b | ((uint64_t)e << 32); }
+		bool pop(uint32 id, uint32& i);
+		bool steal(uint32 id, uint32& i);
+		void work(uint32 id);
+	public:
+		// start thread_count workers, optionally pinning worker i to core i
+		thread_pool(uint32 thread_count = thread::hardware_concurrency(), bool pin = false);
+		~thread_pool();
+
+		thread_pool(const thread_pool&) = delete;
+		thread_pool& operator =(const thread_pool&) = delete;
+
+		// call f(i) for every i in [0, n) on the workers and wait until all of them are done
+		// f must not call parallel_for on the same pool
+		// if progress is set, the calling thread calls progress(completed, n) every interval while it waits and
+		// progress(n, n) once everything is done
+		void parallel_for(uint32 n, const function<void(uint32)>& f,
+			const function<void(uint32, uint32)>& progress = nullptr, chrono::milliseconds interval = chrono::milliseconds(250));
+
+		inline uint32 size() const { return (uint32)threads.size(); }
+		// indices finished and started in the current (or last) parallel_for
+		inline uint32 completed() const { return _completed.load(memory_order_relaxed); }
+		inline uint32 total() const { return _total.load(memory_order_relaxed); }
+
+		// the pool shared by everything that renders
+		static thread_pool& global();
+	};
+}
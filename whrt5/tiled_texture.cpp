@@ -0,0 +1,180 @@
+#include "tiled_texture.h"
+
+namespace whrt5 {
+	tile_cache::tile_cache(size_t budget_bytes) : budget(budget_bytes), _hits(0), _misses(0) {}
+
+	void tile_cache::trim(shard& s) {
+		size_t limit = budget.load(memory_order_relaxed) / shard_count;
+		while (s.used > limit && !s.lru.empty()) {
+			entry& e = s.lru.back();
+			s.used -= e.t->size()*sizeof(vec3);
+			s.index.erase(e.k);
+			s.lru.pop_back();
+		}
+	}
+
+	shared_ptr<const tile_cache::tile> tile_cache::get(const tile_source* src, uint32 level, uint32 index) {
+		key k = { src, level, index };
+		shard& s = shards[shard_of(k)];
+		{
+			lock_guard<mutex> lk(s.m);
+			auto i = s.index.find(k);
+			if (i != s.index.end()) {
+				s.lru.splice(s.lru.begin(), s.lru, i->second);
+				_hits.fetch_add(1, memory_order_relaxed);
+				return i->second->t;
+			}
+		}
+		// read the tile without holding the lock, if another thread read it at the same time its copy is kept instead
+		_misses.fetch_add(1, memory_order_relaxed);
+		auto t = make_shared<tile>(src->tile_pixels());
+		src->load_tile(level, index, t->data());
+		lock_guard<mutex> lk(s.m);
+		auto i = s.index.find(k);
+		if (i != s.index.end()) return i->second->t;
+		s.lru.push_front(entry{ k, t });
+		s.index[k] = s.lru.begin();
+		s.used += t->size()*sizeof(vec3);
+		trim(s);
+		return t;
+	}
+
+	void tile_cache::evict(const tile_source* src) {
+		for (auto& s : shards) {
+			lock_guard<mutex> lk(s.m);
+			for (auto i = s.lru.begin(); i != s.lru.end();) {
+				if (i->k.src == src) {
+					s.used -= i->t->size()*sizeof(vec3);
+					s.index.erase(i->k);
+					i = s.lru.erase(i);
+				}
+				else ++i;
+			}
+		}
+	}
+
+	void tile_cache::set_budget(size_t bytes) {
+		budget = bytes;
+		for (auto& s : shards) {
+			lock_guard<mutex> lk(s.m);
+			trim(s);
+		}
+	}
+
+	size_t tile_cache::resident() {
+		size_t n = 0;
+		for (auto& s : shards) {
+			lock_guard<mutex> lk(s.m);
+			n += s.used;
+		}
+		return n;
+	}
+
+	tile_cache& tile_cache::global() {
+		static tile_cache c(size_t(256) << 20);
+		return c;
+	}
+
+	struct tiled_texture_header {
+		char magic[4];
+		uint32 width, height, tile_size, level_count;
+		uint32 reserved[3];
+	};
+	struct tiled_texture_level {
+		uint32 width, height;
+		uint64_t offset;
+	};
+
+	tiled_texture::tiled_texture(const string& filename, tile_cache& cache) : cache(cache) {
+		file = make_shared<mapped_file>(filename);
+		if (file->size() < sizeof(tiled_texture_header)) throw runtime_error("invalid tiled texture " + filename);
+		const tiled_texture_header* h = (const tiled_texture_header*)file->data();
+		if (h->magic[0] != 'W' || h->magic[1] != 'H' || h->magic[2] != 'T' || h->magic[3] != '1' ||
+			h->tile_size == 0 || h->level_count == 0)
+			throw runtime_error("invalid tiled texture " + filename);
+		if (file->size() < sizeof(tiled_texture_header) + h->level_count*sizeof(tiled_texture_level))
+			throw runtime_error("truncated tiled texture " + filename);
+		tile_size = h->tile_size;
+		const tiled_texture_level* ls = (const tiled_texture_level*)(file->data() + sizeof(tiled_texture_header));
+		size_t tile_bytes = tile_pixels()*sizeof(vec3);
+		for (uint32 i = 0; i < h->level_count; ++i) {
+			level l;
+			l.size = uvec2(ls[i].width, ls[i].height);
+			l.tiles_x = (l.size.x + tile_size - 1) / tile_size;
+			l.offset = ls[i].offset;
+			uint64_t tiles = (uint64_t)l.tiles_x*((l.size.y + tile_size - 1) / tile_size);
+			if (l.size.x == 0 || l.size.y == 0 || l.offset > file->size() || (file->size() - l.offset) / tile_bytes < tiles)
+				throw runtime_error("truncated tiled texture " + filename);
+			levels.push_back(l);
+		}
+	}
+
+	tiled_texture::~tiled_texture() {
+		cache.evict(this);
+	}
+
+	void tiled_texture::write(const string& filename, const texture2d& tx, uint32 tile_size) {
+		texture2d with_mips = tx;
+		if (with_mips.mips.empty()) with_mips.generate_mips();
+		vector<const texture2d*> src;
+		src.push_back(&with_mips);
+		for (const auto& m : with_mips.mips) src.push_back(m.get());
+
+		FILE* f;
+		if (fopen_s(&f, filename.c_str(), "wb") != 0 || f == nullptr)
+			throw runtime_error("couldn't open file " + filename);
+		tiled_texture_header h;
+		h.magic[0] = 'W'; h.magic[1] = 'H'; h.magic[2] = 'T'; h.magic[3] = '1';
+		h.width = tx.size.x; h.height = tx.size.y;
+		h.tile_size = tile_size;
+		h.level_count = (uint32)src.size();
+		h.reserved[0] = h.reserved[1] = h.reserved[2] = 0;
+		fwrite(&h, sizeof(h), 1, f);
+		uint64_t offset = sizeof(h) + src.size()*sizeof(tiled_texture_level);
+		for (auto l : src) {
+			tiled_texture_level tl;
+			tl.width = l->size.x; tl.height = l->size.y;
+			tl.offset = offset;
+			fwrite(&tl, sizeof(tl), 1, f);
+			uvec2 tiles = (l->size + tile_size - 1u) / tile_size;
+			offset += (uint64_t)tiles.x*tiles.y*tile_size*tile_size*sizeof(vec3);
+		}
+		vector<vec3> tile((size_t)tile_size*tile_size);
+		for (auto l : src) {
+			uvec2 tiles = (l->size + tile_size - 1u) / tile_size;
+			for (uint32 ty = 0; ty < tiles.y; ++ty) {
+				for (uint32 tx = 0; tx < tiles.x; ++tx) {
+					for (uint32 y = 0; y < tile_size; ++y)
+						for (uint32 x = 0; x < tile_size; ++x)
+							tile[y*tile_size + x] = l->pixel(glm::min(uvec2(tx, ty)*tile_size + uvec2(x, y), l->size - 1u));
+					if (fwrite(tile.data(), sizeof(vec3), tile.size(), f) != tile.size()) {
+						fclose(f);
+						throw runtime_error("couldn't write tiled texture " + filename);
+					}
+				}
+			}
+		}
+		fclose(f);
+	}
+
+	void tiled_texture::load_tile(uint32 l, uint32 index, vec3* out) const {
+		size_t bytes = tile_pixels()*sizeof(vec3);
+		memcpy(out, file->data() + levels[l].offset + index*bytes, bytes);
+	}
+
+	vec3 tiled_texture::texel(vec2 c) const {
+		c = mod(c, vec2(1.f));
+		uvec2 ic = floor(c*(vec2)size());
+		return pixel(0, glm::min(ic, size() - 1u));
+	}
+
+	vec3 tiled_texture::bilinear(uint32 l, vec2 c) const {
+		return bilinear_filter(levels[l].size, c, reader(this, l));
+	}
+
+	vec3 tiled_texture::texel(vec2 c, vec2 dx, vec2 dy) const {
+		return trilinear_filter(size(), levels.size() - 1, c, dx, dy, [this](size_t l, vec2 c) {
+			return bilinear((uint32)l, c);
+		});
+	}
+}
@@ -0,0 +1,148 @@
+#pragma once
+#include "cmmn.h"
+#include "texture.h"
+#include "mapped_file.h"
+#include <atomic>
+#include <list>
+#include <unordered_map>
+
+namespace whrt5 {
+	// anything that can fill in tiles for a tile_cache
+	class tile_source {
+	public:
+		virtual ~tile_source() {}
+		// number of pixels in each tile
+		virtual size_t tile_pixels() const = 0;
+		// read tile index of mip level into out, which has tile_pixels() pixels
+		virtual void load_tile(uint32 level, uint32 index, vec3* out) const = 0;
+	};
+
+	/*
+		tiles of textures that are too big to keep in memory, kept under a budget of bytes
+		when a new tile would go over the budget the least recently used tiles are dropped. tiles are handed out as
+		shared_ptrs, so a tile that is dropped while a lookup is still reading it lives until that lookup is done
+		the tiles are split between shards by a hash of their key, each with its own lock and LRU list, so that
+		threads looking up different tiles rarely wait for each other. each shard gets an equal part of the budget
+	*/
+	class tile_cache {
+	public:
+		typedef vector<vec3> tile;
+	private:
+		struct key {
+			const tile_source* src;
+			uint32 level, index;
+			bool operator ==(const key& k) const { return src == k.src && level == k.level && index == k.index; }
+		};
+		static inline uint64_t hash(const key& k) {
+			return rnd::mix((uint64_t)(uintptr_t)k.src ^ ((uint64_t)k.level << 32 | k.index));
+		}
+		struct key_hash {
+			size_t operator ()(const key& k) const { return (size_t)hash(k); }
+		};
+		struct entry {
+			key k;
+			shared_ptr<const tile> t;
+		};
+		struct shard {
+			mutex m;
+			// most recently used at the front
+			list<entry> lru;
+			unordered_map<key, list<entry>::iterator, key_hash> index;
+			size_t used;
+			shard() : used(0) {}
+		};
+		static const uint32 shard_bits = 4, shard_count = 1 << shard_bits;
+		// shards are picked by the top bits of the hash, since the maps inside them pick buckets by the low bits
+		static inline uint32 shard_of(const key& k) { return (uint32)(hash(k) >> (64 - shard_bits)); }
+
+		shard shards[shard_count];
+		atomic<size_t> budget;
+		atomic<uint64_t> _hits, _misses;
+
+		// drop tiles from the back of s until it fits in its part of the budget, s must be locked
+		void trim(shard& s);
+	public:
+		tile_cache(size_t budget_bytes);
+
+		tile_cache(const tile_cache&) = delete;
+		tile_cache& operator =(const tile_cache&) = delete;
+
+		// the tile, loaded from src if it isn't already in the cache
+		shared_ptr<const tile> get(const tile_source* src, uint32 level, uint32 index);
+		// drop every tile of src, which must be done before src is destroyed
+		void evict(const tile_source* src);
+
+		void set_budget(size_t bytes);
+		inline size_t get_budget() const { return budget.load(memory_order_relaxed); }
+		// bytes of tiles in the cache right now
+		size_t resident();
+		inline uint64_t hits() const { return _hits.load(memory_order_relaxed); }
+		inline uint64_t misses() const { return _misses.load(memory_order_relaxed); }
+
+		// the cache shared by every tiled_texture that isn't given its own, 256MB to start with
+		static tile_cache& global();
+	};
+
+	/*
+		a texture that stays on disk in a tiled, mip mapped file and is read a tile at a time through a tile_cache
+		lookups filter the same way texture2d does, and only the tiles they touch are ever read
+
+		file layout, all little endian:
+			header		"WHT1", width, height, tile size, level count, 3 reserved
+			levels		level count * (width, height, 64 bit offset of the level's first tile)
+			tiles		each level's tiles row by row, each tile tile size * tile size * 3 floats row by row
+		tiles that hang off the edge of a level repeat its last row and column
+	*/
+	class tiled_texture : public texture<vec3, vec2>, public tile_source {
+		struct level {
+			uvec2 size;
+			uint32 tiles_x;
+			uint64_t offset;
+		};
+		shared_ptr<mapped_file> file;
+		vector<level> levels;
+		uint32 tile_size;
+		tile_cache& cache;
+
+		// reads pixels of one level, holding on to the last tile it used since neighbouring pixels share tiles
+		struct reader {
+			const tiled_texture* tx;
+			uint32 l;
+			uint32 index;
+			shared_ptr<const tile_cache::tile> t;
+
+			reader(const tiled_texture* tx, uint32 l) : tx(tx), l(l), index(~0u) {}
+			inline vec3 operator ()(uvec2 c) {
+				uint32 ts = tx->tile_size;
+				uint32 i = (c.y / ts)*tx->levels[l].tiles_x + c.x / ts;
+				if (i != index) {
+					t = tx->cache.get(tx, l, i);
+					index = i;
+				}
+				return (*t)[(c.y % ts)*ts + c.x % ts];
+			}
+		};
+	public:
+		// open a file written by write(), throws runtime_error if it is not a valid tiled texture
+		tiled_texture(const string& filename, tile_cache& cache = tile_cache::global());
+		~tiled_texture();
+
+		// write tx and its mips to a file that can be opened as a tiled_texture, mips are generated if tx has none
+		static void write(const string& filename, const texture2d& tx, uint32 tile_size = 64);
+
+		// size of the full resolution level in pixels
+		inline uvec2 size() const { return levels[0].size; }
+		inline uint32 level_count() const { return (uint32)levels.size(); }
+
+		// gets a pixel of mip level l, which must be in [0, level size)
+		vec3 pixel(uint32 l, uvec2 c) const { return reader(this, l)(c); }
+
+		vec3 texel(vec2 c) const override;
+		vec3 bilinear(uint32 l, vec2 c) const;
+		vec3 texel(vec2 c, vec2 dx, vec2 dy) const override;
+		bool filtered() const override { return true; }
+
+		size_t tile_pixels() const override { return (size_t)tile_size*tile_size; }
+		void load_tile(uint32 level, uint32 index, vec3* out) const override;
+	};
+}
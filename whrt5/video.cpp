@@ -1,12 +1,44 @@
 #include "video.h"
+#include "packet.h"
 
 namespace whrt5 {
 	inline unsigned char f2b(float f, float bias) {
 		return clamp(f*255.f + bias, 0.f, 255.f);
 	}
-	video::video(const string& fn, uvec2 frame_size, pair<uint32, uint32> fps) {
-		fopen_s(&of, fn.c_str(), "wb");
-		ogg_stream_init(&ost, rand());
+
+	// SSE version of f2b for 4 values at once, the results are packed into the low 4 bytes
+	inline uint32 f2b4(float4 f, float bias) {
+		__m128i i = _mm_cvttps_epi32(vmin(vmax(f*float4(255.f) + float4(bias), float4(0.f)), float4(255.f)).v);
+		i = _mm_packs_epi32(i, i);
+		return (uint32)_mm_cvtsi128_si32(_mm_packus_epi16(i, i));
+	}
+
+	ycbcr_frame::ycbcr_frame(uvec2 size) {
+		for (int i = 0; i < 3; ++i) {
+			planes[i].width = i == 0 ? size.x : size.x >> 1;
+			planes[i].height = i == 0 ? size.y : size.y >> 1;
+			planes[i].stride = planes[i].width;
+			plane_data[i].resize(planes[i].stride*planes[i].height);
+			planes[i].data = plane_data[i].data();
+		}
+	}
+
+	video::video(const string& fn, uvec2 frame_size, pair<uint32, uint32> fps, thread_pool* conversion_pool)
+		: own_file(true), frame(padded_size(frame_size)), pool(conversion_pool)
+	{
+		if (fopen_s(&of, fn.c_str(), "wb") != 0 || of == nullptr)
+			throw runtime_error("couldn't open file " + fn);
+		start(frame_size, fps, rand());
+	}
+
+	video::video(FILE* f, uvec2 frame_size, pair<uint32, uint32> fps, int serial)
+		: of(f), own_file(false), frame(padded_size(frame_size)), pool(nullptr)
+	{
+		start(frame_size, fps, serial);
+	}
+
+	void video::start(uvec2 frame_size, pair<uint32, uint32> fps, int serial) {
+		ogg_stream_init(&ost, serial);
 
 		th_info ti;
 		th_info_init(&ti);
@@ -43,53 +75,88 @@ namespace whrt5 {
 		fwrite(og.header, 1, og.header_len, of);
 		fwrite(og.body, 1, og.body_len, of);
 	}
-	void video::write_frame(const texture2d& tx, bool last) {
-		auto yuvw = (tx.size.x + 15)&~15, yuvh = (tx.size.y + 15)&~15;
-		th_ycbcr_buffer buf;
-		buf[0].width = yuvw; buf[0].height = yuvh;
-		buf[0].stride = yuvw;
-		auto Y = buf[0].data = new unsigned char[buf[0].stride*buf[0].height];
-
-		buf[1].width = yuvw >> 1; buf[1].height = yuvh >> 1;
-		buf[1].stride = yuvw >> 1;
-		auto U = buf[1].data = new unsigned char[buf[1].stride*buf[1].height];
-
-		buf[2].width = yuvw >> 1; buf[2].height = yuvh >> 1;
-		buf[2].stride = yuvw >> 1;
-		auto V = buf[2].data = new unsigned char[buf[2].stride*buf[2].height];
-
-		for (uint32 y = 0; y < tx.size.y; y += 2) {
-			for (uint32 x = 0; x < tx.size.x; x += 2) {
-				float u = 0.f, v = 0.f;
-				for (uint8 dy = 0; dy < 2; ++dy) {
-					if (y + dy > tx.size.y) dy = 0;
-					for (uint8 dx = 0; dx < 2; ++dx) {
-						if (x + dx > tx.size.x) dx = 0;
-						vec3 pa = tx.pixel(uvec2(x + dx, y + dy));
-						Y[(x + dx) + (y + dy)*yuvw] = f2b(0.299f*pa.r + 0.587f*pa.g + 0.114f*pa.b, 16);
-						u += -0.168736f*pa.r - 0.331264f*pa.g + 0.5f*pa.b;
-						v += 0.5f*pa.r - 0.418688f*pa.g - 0.081312*pa.b;
-					}
+	// convert rows [y0, y1) of tx into the planes, y0 and y1 must be even
+	// odd sized frames repeat their last row and column
+	void ycbcr_frame::convert_rows(const texture2d& tx, uint32 y0, uint32 y1) {
+		unsigned char* Y = planes[0].data, *U = planes[1].data, *V = planes[2].data;
+		uint32 ys = planes[0].stride, cs = planes[1].stride;
+		// rows of textures that aren't stored linearly are copied out first
+		vector<vec3> sa, sb;
+		if (tx.layout() != texture_layout::linear) {
+			sa.resize(tx.size.x);
+			sb.resize(tx.size.x);
+		}
+		for (uint32 y = y0; y < y1; y += 2) {
+			const vec3* ra = tx.row(y, sa.data());
+			const vec3* rb = tx.row(glm::min(y + 1, tx.size.y - 1), sb.data());
+			unsigned char* ya = Y + y*ys, *yb = ya + ys;
+			unsigned char* u = U + (y >> 1)*cs, *v = V + (y >> 1)*cs;
+			uint32 x = 0;
+			for (; x + 4 <= tx.size.x; x += 4) {
+				float4 r0, g0, b0, r1, g1, b1;
+				load_rgb4(ra + x, r0, g0, b0);
+				load_rgb4(rb + x, r1, g1, b1);
+				uint32 la = f2b4(float4(0.299f)*r0 + float4(0.587f)*g0 + float4(0.114f)*b0, 16.f);
+				uint32 lb = f2b4(float4(0.299f)*r1 + float4(0.587f)*g1 + float4(0.114f)*b1, 16.f);
+				memcpy(ya + x, &la, 4);
+				memcpy(yb + x, &lb, 4);
+				// average each 2x2 block, the averages end up in lanes 0 and 2
+				auto box = [](float4 a, float4 b) {
+					__m128 s = (a + b).v;
+					return float4(_mm_add_ps(_mm_shuffle_ps(s, s, _MM_SHUFFLE(2, 2, 0, 0)), _mm_shuffle_ps(s, s, _MM_SHUFFLE(3, 3, 1, 1))))*float4(.25f);
+				};
+				float4 r = box(r0, r1), g = box(g0, g1), b = box(b0, b1);
+				uint32 cu = f2b4(float4(-0.168736f)*r - float4(0.331264f)*g + float4(0.5f)*b, 128.f);
+				uint32 cv = f2b4(float4(0.5f)*r - float4(0.418688f)*g - float4(0.081312f)*b, 128.f);
+				u[x >> 1] = (unsigned char)cu; u[(x >> 1) + 1] = (unsigned char)(cu >> 16);
+				v[x >> 1] = (unsigned char)cv; v[(x >> 1) + 1] = (unsigned char)(cv >> 16);
+			}
+			for (; x < tx.size.x; x += 2) {
+				vec3 avg = vec3(0.f);
+				for (uint32 dx = 0; dx < 2; ++dx) {
+					uint32 px = glm::min(x + dx, tx.size.x - 1);
+					vec3 pa = ra[px], pb = rb[px];
+					ya[x + dx] = f2b(0.299f*pa.r + 0.587f*pa.g + 0.114f*pa.b, 16);
+					yb[x + dx] = f2b(0.299f*pb.r + 0.587f*pb.g + 0.114f*pb.b, 16);
+					avg += (pa + pb)*.25f;
 				}
-				U[(x >> 1) + (y >> 1) * (yuvw >> 1)] = f2b(u, 128);
-				V[(x >> 1) + (y >> 1) * (yuvw >> 1)] = f2b(v, 128);
+				u[x >> 1] = f2b(-0.168736f*avg.r - 0.331264f*avg.g + 0.5f*avg.b, 128);
+				v[x >> 1] = f2b(0.5f*avg.r - 0.418688f*avg.g - 0.081312f*avg.b, 128);
 			}
 		}
+	}
 
+	void ycbcr_frame::convert(const texture2d& tx, thread_pool* pool) {
+		if (tx.size.x > (uint32)planes[0].width || tx.size.y > (uint32)planes[0].height)
+			throw runtime_error("frame is larger than its Y'CbCr planes");
+		uint32 rows = (tx.size.y + 1) & ~1u;
+		if (pool != nullptr) {
+			const uint32 band = 16;
+			pool->parallel_for((rows + band - 1) / band, [&](uint32 i) {
+				convert_rows(tx, i*band, glm::min(rows, (i + 1)*band));
+			});
+		}
+		else
+			convert_rows(tx, 0, rows);
+	}
+
+	void video::write_frame(const texture2d& tx, bool last) {
+		frame.convert(tx, pool);
+		write_frame(frame.planes, last);
+	}
+	void video::write_frame(th_ycbcr_buffer planes, bool last) {
 		ogg_packet op; ogg_page og;
-		th_encode_ycbcr_in(enc, buf);
+		th_encode_ycbcr_in(enc, planes);
 		th_encode_packetout(enc, last, &op);
 		ogg_stream_packetin(&ost, &op);
 		while (ogg_stream_pageout(&ost, &og)) {
 			fwrite(og.header, 1, og.header_len, of);
 			fwrite(og.body, 1, og.body_len, of);
 		}
-
-		delete[] Y, U, V;
 	}
 	void video::flush() {
 		ogg_page og;
-		if (ogg_stream_flush(&ost, &og)) {
+		while (ogg_stream_flush(&ost, &og)) {
 			fwrite(og.header, 1, og.header_len, of);
 			fwrite(og.body, 1, og.body_len, of);
 		}
@@ -99,6 +166,6 @@ namespace whrt5 {
 		flush();
 		th_encode_free(enc);
 		ogg_stream_clear(&ost);
-		fclose(of);
+		if (own_file) fclose(of);
 	}
 }
@@ -1,19 +1,54 @@
 #pragma once
 #include "cmmn.h"
 #include "texture.h"
+#include "thread_pool.h"
 
 #include <ogg/ogg.h>
 #include <theora/theoraenc.h>
 
 namespace whrt5 {
+	// a Y'CbCr 4:2:0 frame whose planes are allocated once and reused for every frame converted into them
+	class ycbcr_frame {
+		vector<unsigned char> plane_data[3];
+		void convert_rows(const texture2d& tx, uint32 y0, uint32 y1);
+	public:
+		th_ycbcr_buffer planes;
+
+		// size is the size of the luma plane and must be even, the chroma planes are half of it
+		ycbcr_frame(uvec2 size);
+		ycbcr_frame(const ycbcr_frame&) = delete;
+		ycbcr_frame& operator =(const ycbcr_frame&) = delete;
+
+		// convert tx into the planes, if pool is set the rows are split into bands that run on it
+		void convert(const texture2d& tx, thread_pool* pool = nullptr);
+	};
+
 	// video output via Ogg Theora encoding
 	class video {
 		FILE* of;
+		bool own_file;
 		ogg_stream_state ost;
 		th_enc_ctx* enc;
+		ycbcr_frame frame;
+		// if set, the color conversion runs on this pool
+		thread_pool* pool;
+
+		void start(uvec2 frame_size, pair<uint32, uint32> fps, int serial);
 	public:
-		video(const string& fn, uvec2 frame_size, pair<uint32, uint32> fps);
+		video(const string& fn, uvec2 frame_size, pair<uint32, uint32> fps, thread_pool* conversion_pool = nullptr);
+		// write a stream with the given Ogg serial number to f, which stays open after the video is destroyed
+		video(FILE* f, uvec2 frame_size, pair<uint32, uint32> fps, int serial);
+		video(const video&) = delete;
+		video& operator =(const video&) = delete;
+
+		// the Theora frame size for a picture size, rounded up to multiples of 16
+		static inline uvec2 padded_size(uvec2 frame_size) {
+			return uvec2((frame_size.x + 15) & ~15u, (frame_size.y + 15) & ~15u);
+		}
+
 		void write_frame(const texture2d& tx, bool last);
+		// write a frame that is already in Y'CbCr, the planes must be padded_size
+		void write_frame(th_ycbcr_buffer planes, bool last);
 		void flush();
 
 		~video();